@@ -26,25 +26,264 @@
  * Keep the system heatppm is to run on as idle as possible whith the exception
  * of chronyd, gpsd and unidled and assert that the system has cooled down
  * before starting heatppm. Running heatppm can take many hours, so be patient.
+ *
+ * The tracking data is fetched once per second directly from chronyd using
+ * its binary command protocol over a persistent connection to the command
+ * socket (default /var/run/chrony/chronyd.sock, like chronyc a client socket
+ * is bound in the same directory) instead of running "chronyc -c tracking".
+ * If the socket is not accessible the udp command port of localhost is used.
+ * Values are rounded to the precision chronyc displays.
+ *
+ * All hwmon temperature inputs are kept open and read several times per
+ * second (-o), the per second mean of a sensor is used. Without "-t" the
+ * sensors are surveyed for a minute first and the one with the least noise
+ * (including its resolution) is selected. During the run the correlation of
+ * every sensor with the chronyd frequency is tracked and a ranked list is
+ * printed to stderr at the end, the best sensor is the one to use for the
+ * chronyd temperature compensation.
+ *
+ * The processor is heated by one worker thread per selected core (-C, all
+ * cores by default) running a vectorized floating point load for a part of
+ * every 10ms period, all workers at the same phase. "-i" limits the duty
+ * cycle and thus the maximum heat. The workers run with normal priority so
+ * realtime tasks like chronyd, gpsd and unidled are not disturbed. The
+ * original method of forcing poll idle via /dev/cpu_dma_latency for a part
+ * of every second is still available as a low power option (-d).
+ *
+ * The heater is driven by a feed forward plus PI controller working on the
+ * per second temperature. Unless a model is given (-k), a step response is
+ * measured first: the heater is switched to a fixed duty (-a, 20% default)
+ * until the temperature is steady, a first order plus dead time model is
+ * fitted (two point method) and the gains are derived from it (SIMC rules).
+ * Feed forward is the duty the model needs for the target, the integral
+ * only corrects the model error and is not updated while the heater output
+ * is saturated (anti windup). Pass the reported model with "-k" next time
+ * to skip the step response.
  */
 
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <sys/timerfd.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
 #include <sched.h>
+#include <glob.h>
+#include <time.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#define CHRONYSOCK	"/var/run/chrony/chronyd.sock"
+#define CHRONYPORT	323
+
+#define PROTO_VERSION	6
+#define PKT_REQUEST	1
+#define PKT_REPLY	2
+#define REQ_TRACKING	33
+#define RPY_TRACKING	5
+#define NOHIGHSEC	0x7fffffff
+
+#define PERIOD		10000000L
+#define BURST		256
+
+#define MAXTUNE		1800
+#define STEADY		30
+
+#define MAXSENS		32
+#define MAXOVER		50
+#define SURVEY		60
+
+struct chreq
+{
+	uint8_t version;
+	uint8_t type;
+	uint8_t res1;
+	uint8_t res2;
+	uint16_t command;
+	uint16_t attempt;
+	uint32_t sequence;
+	uint32_t pad1;
+	uint32_t pad2;
+	uint8_t pad[88];	/* chronyd wants requests as long as the reply */
+};
+
+struct chrpy
+{
+	uint8_t version;
+	uint8_t type;
+	uint8_t res1;
+	uint8_t res2;
+	uint16_t command;
+	uint16_t reply;
+	uint16_t status;
+	uint16_t pad1;
+	uint16_t pad2;
+	uint16_t pad3;
+	uint32_t sequence;
+	uint32_t pad4;
+	uint32_t pad5;
+	uint32_t refid;
+	uint8_t addr[20];
+	uint16_t stratum;
+	uint16_t leap;
+	uint32_t sechigh;
+	uint32_t seclow;
+	uint32_t nsec;
+	uint32_t corr;
+	uint32_t last;
+	uint32_t rms;
+	uint32_t freq;
+	uint32_t resid;
+	uint32_t skew;
+	uint32_t delay;
+	uint32_t disp;
+	uint32_t intvl;
+	uint32_t eor;
+};
+
+struct sensor
+{
+	int fd;
+	int cnt;
+	long step;
+	long last;
+	long smp[MAXOVER];
+	unsigned long secs;
+	unsigned long n;
+	double val;
+	double noise;
+	double t0;
+	double f0;
+	double sx;
+	double sy;
+	double sxx;
+	double syy;
+	double sxy;
+	char path[128];
+	char name[64];
+};
+
 static int hfd;
 static int cfd;
+static int nsens;
+static volatile sig_atomic_t stop;
+static double ty[MAXTUNE];
+static struct sensor sens[MAXSENS];
+static int sfd=-1;
 static long on;
+static long duty=100;
+static long long hbase;
+static volatile float sink;
+static uint32_t seq;
+static char *csock=CHRONYSOCK;
+static char lsock[sizeof(((struct sockaddr_un *)0)->sun_path)];
 static pthread_mutex_t mtx=PTHREAD_MUTEX_INITIALIZER;
 
+typedef float vec __attribute__((vector_size(32)));
+
+static long long mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static void *heater(void *arg)
+{
+	int i;
+	long val;
+	long long t;
+	long long end;
+	cpu_set_t set;
+	struct timespec ts;
+	vec a[8];
+	vec m;
+	vec o;
+
+	CPU_ZERO(&set);
+	CPU_SET((int)(long)arg,&set);
+	if(pthread_setaffinity_np(pthread_self(),sizeof(set),&set))
+	{
+		fprintf(stderr,"can't pin heater to core %d\n",(int)(long)arg);
+		exit(1);
+	}
+
+	/* independent multiply-adds converging to 1, no denormals */
+
+	for(i=0;i<8;i++)a[i]=(vec){1,1,1,1,1,1,1,1}*(float)(i+1);
+	m=(vec){1,1,1,1,1,1,1,1}*0.999f;
+	o=(vec){1,1,1,1,1,1,1,1}*0.001f;
+
+	for(t=hbase;;t+=PERIOD)
+	{
+		ts.tv_sec=t/1000000000;
+		ts.tv_nsec=t%1000000000;
+		while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL));
+
+		pthread_mutex_lock(&mtx);
+		val=on;
+		pthread_mutex_unlock(&mtx);
+
+		/* the on time per second is spread over the periods */
+
+		end=t+(long long)val*duty/100*PERIOD/1000000000;
+		while(mono()<end)for(i=0;i<BURST;i++)
+		{
+			a[0]=a[0]*m+o;
+			a[1]=a[1]*m+o;
+			a[2]=a[2]*m+o;
+			a[3]=a[3]*m+o;
+			a[4]=a[4]*m+o;
+			a[5]=a[5]*m+o;
+			a[6]=a[6]*m+o;
+			a[7]=a[7]*m+o;
+		}
+
+		/* skip periods missed, e.g. due to realtime tasks */
+
+		if((end=mono())>t+PERIOD)t+=(end-t)/PERIOD*PERIOD;
+		sink=a[0][0]+a[7][7];
+	}
+
+	pthread_exit(NULL);
+}
+
+static int cpulist(char *list,cpu_set_t *set)
+{
+	long a;
+	long b;
+	char *end;
+
+	CPU_ZERO(set);
+	while(1)
+	{
+		a=b=strtol(list,&end,10);
+		if(end==list||a<0||a>=CPU_SETSIZE)return -1;
+		if(*end=='-')
+		{
+			list=end+1;
+			b=strtol(list,&end,10);
+			if(end==list||b<a||b>=CPU_SETSIZE)return -1;
+		}
+		for(;a<=b;a++)CPU_SET(a,set);
+		if(!*end)break;
+		if(*end!=',')return -1;
+		list=end+1;
+	}
+	return 0;
+}
+
 static void *pwm(void *unused)
 {
 	int x;
@@ -147,83 +386,401 @@ static void *pwm(void *unused)
 	pthread_exit(NULL);
 }
 
+static void unbind(void)
+{
+	if(*lsock)unlink(lsock);
+	*lsock=0;
+}
+
+static void die(int unused)
+{
+	stop=1;
+}
+
+static int chrony(void)
+{
+	char *p;
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+
+	if(sfd!=-1)close(sfd);
+	unbind();
+
+	/* chronyd replies to the client socket which thus must be bound */
+
+	if(strlen(csock)>=sizeof(un.sun_path)||!(p=strrchr(csock,'/')))
+		goto udp;
+	if((sfd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0))==-1)goto udp;
+	memset(&un,0,sizeof(un));
+	un.sun_family=AF_UNIX;
+	if(snprintf(un.sun_path,sizeof(un.sun_path),"%.*s/heatppm.%d.sock",
+		(int)(p-csock),csock,(int)getpid())>=sizeof(un.sun_path))
+		goto fail;
+	unlink(un.sun_path);
+	if(bind(sfd,(struct sockaddr *)&un,sizeof(un)))goto fail;
+	strcpy(lsock,un.sun_path);
+
+	/* chronyd drops its privileges but must be able to reply */
+
+	if(chmod(lsock,0666))goto fail;
+	strcpy(un.sun_path,csock);
+	if(!connect(sfd,(struct sockaddr *)&un,sizeof(un)))return 0;
+
+fail:	close(sfd);
+	unbind();
+
+udp:	if((sfd=socket(AF_INET,SOCK_DGRAM|SOCK_CLOEXEC,0))==-1)return -1;
+	memset(&in,0,sizeof(in));
+	in.sin_family=AF_INET;
+	in.sin_port=htons(CHRONYPORT);
+	in.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	if(!connect(sfd,(struct sockaddr *)&in,sizeof(in)))return 0;
+	close(sfd);
+	sfd=-1;
+	return -1;
+}
+
+static double chfloat(uint32_t val)
+{
+	int exp;
+	int coef;
+	double d;
+
+	/* 7 bit exponent, 25 bit coefficient, both signed */
+
+	val=ntohl(val);
+	exp=(int)(val>>25);
+	if(exp>=64)exp-=128;
+	exp-=25;
+	coef=(int)(val&0x1ffffff);
+	if(coef>=0x1000000)coef-=0x2000000;
+
+	for(d=coef;exp>0;exp--)d*=2;
+	for(;exp<0;exp++)d/=2;
+
+	/* the loop decisions are based on what chronyc displays */
+
+	return (double)(long long)(d*1000+(d<0?-0.5:0.5))/1000;
+}
+
 static int tracer(double *time,double *freq,double *res,double *skew)
 {
-	FILE *fp;
-	char *t;
-	char *f;
-	char *r;
-	char *s;
-	char *mem;
-	char line[256];
-
-	if(!(fp=popen("chronyc -c tracking","re")))return -1;
-	if(!fgets(line,sizeof(line),fp))
+	int i;
+	int l;
+	int renew=1;
+	struct pollfd p;
+	struct chreq req;
+	struct chrpy rpy;
+
+	if(sfd==-1&&chrony())return -1;
+
+	memset(&req,0,sizeof(req));
+	req.version=PROTO_VERSION;
+	req.type=PKT_REQUEST;
+	req.command=htons(REQ_TRACKING);
+	req.sequence=htonl(++seq);
+
+	for(i=0;i<3;i++)
+	{
+		req.attempt=htons(i);
+		if(send(sfd,&req,sizeof(req),0)!=sizeof(req))
+		{
+			/* e.g. chronyd was restarted, reconnect once */
+
+			if(!renew--||chrony())return -1;
+			if(send(sfd,&req,sizeof(req),0)!=sizeof(req))return -1;
+		}
+
+		p.fd=sfd;
+		p.events=POLLIN;
+		while(poll(&p,1,100)==1)
+		{
+			if((l=recv(sfd,&rpy,sizeof(rpy),0))==-1)break;
+			if(l!=sizeof(rpy)||rpy.version!=PROTO_VERSION||
+			    rpy.type!=PKT_REPLY||rpy.command!=req.command||
+			    rpy.sequence!=req.sequence)continue;
+			if(rpy.reply!=htons(RPY_TRACKING)||rpy.status)return -1;
+
+			*time=ntohl(rpy.seclow)+ntohl(rpy.nsec)/1e9;
+			if(ntohl(rpy.sechigh)!=NOHIGHSEC)
+				*time+=ntohl(rpy.sechigh)*4294967296.0;
+			*freq=chfloat(rpy.freq);
+			*res=chfloat(rpy.resid);
+			*skew=chfloat(rpy.skew);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void label(char *path,char *name,int len)
+{
+	int fd;
+	int l;
+	char *p;
+	char bfr[160];
+	char lbl[32];
+
+	/* hwmon name and, if available, the sensor label */
+
+	*name=0;
+	if(strlen(path)>=sizeof(bfr)-8||!(p=strrchr(path,'/')))return;
+	sprintf(bfr,"%.*s/name",(int)(p-path),path);
+	if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)return;
+	l=read(fd,bfr,sizeof(bfr)-1);
+	close(fd);
+	if(l<1)return;
+	if(bfr[l-1]=='\n')l--;
+	bfr[l]=0;
+	snprintf(name,len,"%.31s",bfr);
+
+	if(strlen(path)>=sizeof(bfr)||!strstr(p,"_input"))return;
+	strcpy(bfr,path);
+	strcpy(strstr(bfr+(p-path),"_input"),"_label");
+	if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)return;
+	l=read(fd,lbl,sizeof(lbl)-1);
+	close(fd);
+	if(l<1)return;
+	if(lbl[l-1]=='\n')l--;
+	lbl[l]=0;
+	l=strlen(name);
+	snprintf(name+l,len-l," %s",lbl);
+}
+
+static int addsens(char *path)
+{
+	int i;
+
+	for(i=0;i<nsens;i++)if(!strcmp(sens[i].path,path))return 0;
+	if(nsens==MAXSENS||strlen(path)>=sizeof(sens[0].path))return -1;
+	if((sens[nsens].fd=open(path,O_RDONLY|O_CLOEXEC))==-1)return -1;
+	strcpy(sens[nsens].path,path);
+	label(path,sens[nsens].name,sizeof(sens[nsens].name));
+	sens[nsens++].step=0;
+	return 0;
+}
+
+static int sensors(char *src)
+{
+	int i;
+	glob_t g;
+
+	/* a given source always is the first sensor */
+
+	if(src&&addsens(src))return -1;
+	if(!glob("/sys/class/hwmon/hwmon*/temp*_input",0,NULL,&g))
 	{
-		pclose(fp);
-		return -1;
+		for(i=0;i<g.gl_pathc;i++)addsens(g.gl_pathv[i]);
+		globfree(&g);
 	}
-	pclose(fp);
-
-	strtok_r(line,",\n",&mem);
-	strtok_r(NULL,",\n",&mem);
-	strtok_r(NULL,",\n",&mem);
-	t=strtok_r(NULL,",\n",&mem);
-	strtok_r(NULL,",\n",&mem);
-	strtok_r(NULL,",\n",&mem);
-	strtok_r(NULL,",\n",&mem);
-	f=strtok_r(NULL,",\n",&mem);
-	r=strtok_r(NULL,",\n",&mem);
-	s=strtok_r(NULL,",\n",&mem);
-
-	if(!t||!*t||!f||!*f||!r||!*r||!s||!*s)return -1;
-
-	*time=strtod(t,&mem);
-	if(*mem)return -1;
-	*freq=strtod(f,&mem);
-	if(*mem)return -1;
-	*res=strtod(r,&mem);
-	if(*mem)return -1;
-	*skew=strtod(s,&mem);
-	if(*mem)return -1;
+	return nsens?0:-1;
+}
+
+static int sample(int sel)
+{
+	int i;
+	int l;
+	long v;
+	char *end;
+	char bfr[32];
+
+	for(i=0;i<nsens;i++)if(sens[i].fd!=-1)
+	{
+		if((l=pread(sens[i].fd,bfr,sizeof(bfr)-1,0))<1)goto fail;
+		bfr[l]=0;
+		v=strtol(bfr,&end,10);
+		if(end==bfr||(*end&&*end!='\n'))goto fail;
+
+		/* the smallest change seen is the resolution */
+
+		if((sens[i].cnt||sens[i].secs)&&v!=sens[i].last)
+		{
+			l=labs(v-sens[i].last);
+			if(!sens[i].step||l<sens[i].step)sens[i].step=l;
+		}
+		sens[i].smp[sens[i].cnt++]=sens[i].last=v;
+		continue;
 
+fail:		if(i==sel)return -1;
+		close(sens[i].fd);
+		sens[i].fd=-1;
+	}
 	return 0;
 }
 
-static int temp(char *fn,double *temp)
+static void second(void)
+{
+	int i;
+	int j;
+	double d;
+	double avg;
+
+	for(i=0;i<nsens;i++)if(sens[i].fd!=-1&&sens[i].cnt)
+	{
+		for(j=0,avg=0;j<sens[i].cnt;j++)avg+=sens[i].smp[j];
+		avg/=sens[i].cnt;
+		sens[i].val=avg;
+
+		/* mean absolute deviation of the reads within a second */
+
+		for(j=0,d=0;j<sens[i].cnt;j++)
+			d+=sens[i].smp[j]>avg?sens[i].smp[j]-avg:
+				avg-sens[i].smp[j];
+		sens[i].noise+=d/sens[i].cnt;
+		sens[i].secs++;
+		sens[i].cnt=0;
+	}
+}
+
+static void correlate(double freq)
 {
-	FILE *fp;
-	char *t;
-	char *mem;
-	char line[256];
+	int i;
+	double x;
+	double y;
 
-	if(!(fp=fopen(fn,"re")))return -1;
-	if(!fgets(line,sizeof(line),fp))
+	/* offsets to the first values keep the sums numerically sane */
+
+	for(i=0;i<nsens;i++)if(sens[i].fd!=-1&&sens[i].secs)
 	{
-		fclose(fp);
-		return -1;
+		if(!sens[i].n)
+		{
+			sens[i].t0=sens[i].val;
+			sens[i].f0=freq;
+		}
+		x=(sens[i].val-sens[i].t0)/1000;
+		y=freq-sens[i].f0;
+		sens[i].n++;
+		sens[i].sx+=x;
+		sens[i].sy+=y;
+		sens[i].sxx+=x*x;
+		sens[i].syy+=y*y;
+		sens[i].sxy+=x*y;
 	}
-	fclose(fp);
+}
 
-	t=strtok_r(line,",\n",&mem);
+static double score(struct sensor *s)
+{
+	if(!s->secs||!s->step)return 1e9;
+	return s->noise/s->secs+s->step/2.0;
+}
 
-	if(!t||!*t)return -1;
+static double rsq(struct sensor *s)
+{
+	double vx;
+	double vy;
+	double cv;
+
+	if(s->n<2)return 0;
+	vx=s->n*s->sxx-s->sx*s->sx;
+	vy=s->n*s->syy-s->sy*s->sy;
+	cv=s->n*s->sxy-s->sx*s->sy;
+	if(vx<=0||vy<=0)return 0;
+	return cv*cv/(vx*vy);
+}
 
-	*temp=strtod(t,&mem);
-	if(*mem)return -1;
+static int best(void)
+{
+	int i;
+	int sel=0;
 
+	for(i=1;i<nsens;i++)if(sens[i].fd!=-1)
+		if(sens[sel].fd==-1||score(&sens[i])<score(&sens[sel]))sel=i;
+	return sel;
+}
+
+static void ranking(void)
+{
+	int i;
+	int j;
+	int k;
+	int idx[MAXSENS];
+
+	for(i=0;i<nsens;i++)idx[i]=i;
+	for(i=1;i<nsens;i++)for(j=i;j>0;j--)
+	{
+		if(rsq(&sens[idx[j]])<=rsq(&sens[idx[j-1]]))break;
+		k=idx[j];
+		idx[j]=idx[j-1];
+		idx[j-1]=k;
+	}
+
+	fprintf(stderr,"sensor ranking (r^2 with frequency, noise and "
+		"resolution in millidegrees):\n");
+	for(i=0;i<nsens;i++)if(sens[idx[i]].fd!=-1)
+		fprintf(stderr,"%2d %.3f %6.1f %4ld %s (%s)\n",i+1,
+			rsq(&sens[idx[i]]),sens[idx[i]].secs?
+			sens[idx[i]].noise/sens[idx[i]].secs:0,
+			sens[idx[i]].step,sens[idx[i]].path,
+			sens[idx[i]].name);
+}
+
+static int steady(double *y,int n)
+{
+	int i;
+	double a;
+	double b;
+
+	/* the mean of the last 30 seconds does not move anymore */
+
+	if(n<2*STEADY)return 0;
+	for(i=n-2*STEADY,a=0;i<n-STEADY;i++)a+=y[i];
+	for(b=0;i<n;i++)b+=y[i];
+	return b-a<100*STEADY&&a-b<100*STEADY;
+}
+
+static int identify(double *y,int n,double y0,long step,double *k,
+	double *tau,double *dead)
+{
+	int i;
+	int t28=-1;
+	int t63=-1;
+	double dy;
+
+	for(i=n-STEADY,dy=0;i<n;i++)dy+=y[i];
+	dy=dy/STEADY-y0;
+	if(n<STEADY||dy<500)return -1;
+
+	for(i=0;i<n&&t63==-1;i++)
+	{
+		if(t28==-1&&y[i]-y0>=0.283*dy)t28=i;
+		if(y[i]-y0>=0.632*dy)t63=i;
+	}
+	if(t28==-1||t63==-1)return -1;
+
+	/* first order plus dead time, at least one sample each */
+
+	*k=dy/step;
+	*tau=1.5*(t63-t28);
+	if(*tau<1)*tau=1;
+	*dead=t63-*tau;
+	if(*dead<1)*dead=1;
 	return 0;
 }
 
 static void usage(void)
 {
 	fprintf(stderr,
-		"usage: heatppm [options] -t temperature-source\n"
+		"usage: heatppm [options] [-t temperature-source]\n"
 		"       heatppm -h\n\n"
-		"temperature-source is any of (make a sensible choice):\n"
+		"temperature-source is any of (default: least noisy one):\n"
 		"/sys/class/hwmon/hwmon*/temp*_input\n\n"
 		"Options are:\n"
 		"-h	display this help\n"
+		"-o reads	temperature reads per second (1-50, default 10)\n"
+		"-C cores	cores to heat, e.g. 0-3,6 (default all)\n"
+		"-i duty	maximum heater duty cycle in percent (1-100, "
+			"default 100)\n"
+		"-d	heat by forcing poll idle via cpu dma latency "
+			"(low power)\n"
+		"-a duty	heater duty for the step response in percent "
+			"(1-100, default 20)\n"
+		"-k model	controller model as gain:tau:dead (millidegrees "
+			"per %%,\n"
+		"	seconds, seconds) as reported, skips the step "
+			"response\n"
+		"-c sock	chronyd command socket (default "
+			CHRONYSOCK ")\n"
 		"-w wait	amount of updates from chronyc before "
 			"validation (4-16, default 5)\n"
 		"-l temp	maximum temperature to test for (30-99, "
@@ -246,12 +803,17 @@ int main(int argc,char *argv[])
 	int nohit=0;
 	int nl=0;
 	int wait=5;
+	int over=10;
+	int sub=0;
+	int sel=0;
+	int dma=0;
 	unsigned int base=0;
 	unsigned int ticks=0;
-	long delta;
+	int tune=0;
 	long pulse=0;
+	long step=200000000L;
 	uint64_t dummy;
-	char *info;
+	char *end;
 	char *tempsrc=NULL;
 	double minskew=0.015;
 	double target=0;
@@ -263,14 +825,30 @@ int main(int argc,char *argv[])
 	double freq;
 	double res;
 	double skew;
+	double dev;
+	double err;
+	double u;
+	double kgain=0;
+	double tau=0;
+	double dead=0;
+	double kc=0;
+	double ti=1;
+	double integ=0;
+	double amb=0;
 	double deglst[8];
+	sigset_t set;
+	cpu_set_t cores;
+	cpu_set_t avail;
 	struct pollfd p;
 	struct sched_param sched;
 	struct timeval tv;
 	struct itimerspec it;
 	pthread_t h;
+	pthread_attr_t attr;
 
-	while((x=getopt(argc,argv,"t:w:l:m:rh"))!=-1)switch(x)
+	CPU_ZERO(&cores);
+
+	while((x=getopt(argc,argv,"t:w:l:m:o:c:C:i:a:k:drh"))!=-1)switch(x)
 	{
 	case 't':
 		tempsrc=optarg;
@@ -296,11 +874,70 @@ int main(int argc,char *argv[])
 		xact=0;
 		break;
 
+	case 'c':
+		csock=optarg;
+		break;
+
+	case 'o':
+		over=atoi(optarg);
+		if(over<1||over>MAXOVER)usage();
+		break;
+
+	case 'C':
+		if(cpulist(optarg,&cores))usage();
+		dma|=2;
+		break;
+
+	case 'i':
+		duty=atoi(optarg);
+		if(duty<1||duty>100)usage();
+		break;
+
+	case 'd':
+		dma|=1;
+		break;
+
+	case 'a':
+		x=atoi(optarg);
+		if(x<1||x>100)usage();
+		step=x*10000000L;
+		break;
+
+	case 'k':
+		kgain=strtod(optarg,&end);
+		if(*end++!=':')usage();
+		tau=strtod(end,&end);
+		if(*end++!=':')usage();
+		dead=strtod(end,&end);
+		if(*end||kgain<=0||tau<1||dead<1)usage();
+		kgain/=10000000;
+		break;
+
 	case 'h':
 	default:usage();
 	}
 
-	if(!tempsrc)usage();
+	if(dma==3)usage();
+	if(sched_getaffinity(0,sizeof(avail),&avail))
+	{
+		perror("sched_getaffinity");
+		return 1;
+	}
+	if(!dma)cores=avail;
+	CPU_AND(&avail,&avail,&cores);
+	if(!CPU_EQUAL(&avail,&cores))
+	{
+		fprintf(stderr,"heater core(s) not available\n");
+		return 1;
+	}
+	dma&=1;
+
+	if(sensors(tempsrc))
+	{
+		fprintf(stderr,"can't open temperature source(s)\n");
+		return 1;
+	}
+	if(!tempsrc)inited-=SURVEY;
 
 	memset(&sched,0,sizeof(sched));
 	sched.sched_priority=sched_get_priority_max(SCHED_RR);
@@ -326,7 +963,19 @@ int main(int argc,char *argv[])
 		return 1;
 	}
 
-	if((cfd=open("/dev/cpu_dma_latency",O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)
+	atexit(unbind);
+	signal(SIGINT,die);
+	signal(SIGTERM,die);
+	signal(SIGHUP,die);
+
+	if(chrony())
+	{
+		fprintf(stderr,"can't connect to chronyd\n");
+		return 1;
+	}
+
+	if(dma&&(cfd=open("/dev/cpu_dma_latency",
+		O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)
 	{
 		perror("open");
 		return 1;
@@ -336,30 +985,69 @@ int main(int argc,char *argv[])
 	p.events=POLLIN;
 	on=0;
 
-	if(pthread_create(&h,NULL,pwm,NULL))
+	/* signals end the main loop, the pwm thread must not see them */
+
+	sigemptyset(&set);
+	sigaddset(&set,SIGINT);
+	sigaddset(&set,SIGTERM);
+	sigaddset(&set,SIGHUP);
+	pthread_sigmask(SIG_BLOCK,&set,NULL);
+	if(dma&&pthread_create(&h,NULL,pwm,NULL))
 	{
 		perror("pthread_create");
 		return 1;
 	}
+	if(!dma)
+	{
+		/* the heaters must not compete with realtime tasks */
+
+		memset(&sched,0,sizeof(sched));
+		if(pthread_attr_init(&attr)||
+		    pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED)||
+		    pthread_attr_setschedpolicy(&attr,SCHED_OTHER)||
+		    pthread_attr_setschedparam(&attr,&sched))
+		{
+			perror("pthread_attr");
+			return 1;
+		}
+		hbase=(mono()/PERIOD+1)*PERIOD;
+		for(i=0;i<CPU_SETSIZE;i++)if(CPU_ISSET(i,&cores))
+			if(pthread_create(&h,&attr,heater,(void *)(long)i))
+		{
+			perror("pthread_create");
+			return 1;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	pthread_sigmask(SIG_UNBLOCK,&set,NULL);
 
 	printf("\rWait...");
 	fflush(stdout);
 	nl=1;
 
-	while(1)
+	while(!stop)
 	{
 		gettimeofday(&tv,NULL);
 		if(tv.tv_usec>=450000&&tv.tv_usec<=550000)break;
 		usleep(5000);
 	}
 
-	if(timerfd_settime(tfd,0,&it,NULL))
+	if(dma&&timerfd_settime(hfd,0,&it,NULL))
 	{
 		perror("timerfd_settime");
 		return 1;
 	}
 
-	if(timerfd_settime(hfd,0,&it,NULL))
+	/* the first read of a second is at the same phase as before */
+
+	it.it_interval.tv_sec=0;
+	it.it_interval.tv_nsec=1000000000L/over;
+	if(over==1)
+	{
+		it.it_interval.tv_sec=1;
+		it.it_interval.tv_nsec=0;
+	}
+	if(timerfd_settime(tfd,0,&it,NULL))
 	{
 		perror("timerfd_settime");
 		return 1;
@@ -369,11 +1057,12 @@ int main(int argc,char *argv[])
 	fflush(stdout);
 	nl=1;
 
-	while(1)
+	while(!stop)
 	{
 		switch(poll(&p,1,-1))
 		{
-		case -1:perror("poll");
+		case -1:if(errno==EINTR)continue;
+			perror("poll");
 			return 1;
 
 		case 0:	continue;
@@ -383,14 +1072,18 @@ int main(int argc,char *argv[])
 			break;
 		}
 
-		if(temp(tempsrc,&deg))
+		if(sample(tempsrc||inited>-8?sel:-1))
 		{
 			fprintf(stderr,"can't read temperature data\n");
 			return 1;
 		}
+		if(++sub<over)continue;
+		sub=0;
+		second();
 
 		if(tracer(&curr,&freq,&res,&skew))
 		{
+			if(stop)break;
 			fprintf(stderr,"can't get chrony tracking data\n");
 			return 1;
 		}
@@ -401,6 +1094,17 @@ int main(int argc,char *argv[])
 			prev=curr;
 		}
 
+		correlate(freq);
+
+		if(inited==-8&&!tempsrc)
+		{
+			sel=best();
+			fprintf(stderr,"\rusing %s (%s), noise %.1f, "
+				"resolution %ld\n",sens[sel].path,sens[sel].name,
+				sens[sel].noise/sens[sel].secs,sens[sel].step);
+		}
+		deg=sens[sel].val;
+
 		deglst[idx++]=deg;
 		idx&=7;
 		if(inited<0)
@@ -432,7 +1136,7 @@ int main(int argc,char *argv[])
 				base=ticks;
 				nohit=0;
 
-				if(avg==target)
+				if(deg-target<0.5&&deg-target>-0.5)
 				{
 					printf("\r%.0f %.3f"
 						"          "
@@ -441,7 +1145,7 @@ int main(int argc,char *argv[])
 						"          "
 						"          "
 						"          "
-						"\n",avg,freq);
+						"\n",deg,freq);
 					target+=1000;
 					nl=0;
 				}
@@ -454,71 +1158,75 @@ int main(int argc,char *argv[])
 		for(i=0,avg=0;i<8;i++)avg+=deglst[i];
 		avg/=8;
 
-		if(avg<target)
+		if(!tau)
 		{
-			if(target-avg>500)
-			{
-				delta=1000000L;
-				info=">>>";
-			}
-			else if(target-avg>250)
-			{
-				delta=500000L;
-				info=" >>";
-			}
-			else
+			/* step response, the heater was off until now */
+
+			if(!tune)
 			{
-				delta=100000L;
-				info=" > ";
+				amb=avg;
+				pulse=step;
+				pthread_mutex_lock(&mtx);
+				on=pulse;
+				pthread_mutex_unlock(&mtx);
 			}
-			if(pulse+delta>1000000000L)
+			ty[tune++]=deg;
+
+			printf("\r%3.3f [ step ] %5.1f%% % 4.3f % 4.3f % 3.3f",
+				deg/1000,pulse/1e7,freq,res,skew);
+			fflush(stdout);
+			nl=1;
+
+			if(tune<MAXTUNE&&avg<high&&!steady(ty,tune))continue;
+			if(identify(ty,tune,amb,step,&kgain,&tau,&dead))
 			{
-				pulse=1000000000L;
-				info=" >|";
+				fprintf(stderr,"\rstep response unusable, "
+					"try another -a\n");
+				return 1;
 			}
-			else pulse+=delta;
+			fprintf(stderr,"\rmodel %.1f:%.0f:%.0f (gain "
+				"millidegrees per %%, time constant, dead time)\n",
+				kgain*1e7,tau,dead);
+			base=ticks;
+			nohit=0;
 		}
-		else if(avg>target)
+		else if(!amb)amb=avg;
+
+		if(!kc)
 		{
-			if(avg-target>500)
-			{
-				delta=1000000L;
-				info="<<<";
-			}
-			else if(avg-target>250)
-			{
-				delta=500000L;
-				info="<< ";
-			}
-			else
-			{
-				delta=100000L;
-				info=" < ";
-			}
-			if(pulse-delta<0L)
-			{
-				pulse=0L;
-				info="|< ";
-			}
-			else pulse-=delta;
+			/* SIMC, closed loop time constant at least 10 samples */
+
+			u=(dead<10?10:dead)+dead;
+			kc=tau/(kgain*u);
+			ti=tau<4*u?tau:4*u;
 		}
-		else
+
+		/* no integration while saturated in the error direction */
+
+		err=target-deg;
+		integ+=err;
+		u=(target-amb)/kgain+kc*(err+integ/ti);
+		if((u>1e9&&err>0)||(u<0&&err<0))
 		{
-			delta=0L;
-			info=" - ";
+			integ-=err;
+			u=(target-amb)/kgain+kc*(err+integ/ti);
 		}
+		pulse=u<0?0L:u>1e9?1000000000L:(long)u;
 
 		pthread_mutex_lock(&mtx);
 		on=pulse;
 		pthread_mutex_unlock(&mtx);
 
-		printf("\r%3.3f [%3.3f] %s % 4.3f % 4.3f % 3.3f",
-			avg/1000,target/1000,info,freq,res,skew);
+		printf("\r%3.3f [%3.3f] %5.1f%% % 4.3f % 4.3f % 3.3f",
+			deg/1000,target/1000,pulse/1e7,freq,res,skew);
 		fflush(stdout);
 		nl=1;
 
-		if((xact&&delta)||delta>100000L||ticks-base<wait||res||
-			skew>minskew)
+		/* the oversampled mean, exact means to the millidegree */
+
+		dev=deg-target;
+		if((xact&&(dev>=0.5||dev<=-0.5))||dev>250||dev<-250||
+			ticks-base<wait||res||skew>minskew)
 		{
 			if(++nohit>=3600)break;
 			continue;
@@ -531,7 +1239,7 @@ int main(int argc,char *argv[])
 			"          "
 			"          "
 			"          "
-			"\n",avg,freq);
+			"\n",deg,freq);
 		target+=1000;
 		nl=0;
 		base=ticks;
@@ -549,5 +1257,7 @@ int main(int argc,char *argv[])
 		"          \r");
 	fflush(stdout);
 
+	ranking();
+
 	return 0;
 }
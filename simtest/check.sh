@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# replays the pps traces with the simulation build and compares the idle
+# control writes to the expected logs, "check.sh -u" regenerates both,
+# each case below is name|trace generator options|replay options
+#
+dir=`dirname $0`
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf $tmp' 0
+fail=0
+
+${CC:-cc} -Wall -O2 -DSIMULATE -o $tmp/unidled $dir/../unidled.c -lrt \
+	-lpthread || exit 1
+
+cpu=$tmp/root/sys/devices/system/cpu/cpu0
+mkdir -p $cpu/power $tmp/root/dev
+: > $tmp/root/dev/cpu_dma_latency
+echo 0 > $cpu/power/pm_qos_resume_latency_us
+for s in 0:POLL:0 1:C1:2 2:C1E:10 3:C6:133
+do
+	n=`echo $s | cut -d: -f1`
+	mkdir -p $cpu/cpuidle/state$n
+	echo $s | cut -d: -f2 > $cpu/cpuidle/state$n/name
+	echo $s | cut -d: -f3 > $cpu/cpuidle/state$n/latency
+	echo 0 > $cpu/cpuidle/state$n/disable
+done
+
+while IFS='|' read name gen opts
+do
+	if [ "$1" = "-u" ]
+	then
+		$tmp/unidled -R $tmp/root $gen > $dir/$name.trace || exit 1
+	fi
+	if ! $tmp/unidled -R $tmp/root -d $dir/$name.trace -c 0 -n $opts \
+		> $tmp/$name.log 2> $tmp/$name.err
+	then
+		echo "$name: FAILED"
+		grep "poll check" $tmp/$name.err
+		fail=1
+	elif [ "$1" = "-u" ]
+	then
+		cp $tmp/$name.log $dir/$name.log
+		echo "$name: updated"
+	elif ! cmp -s $tmp/$name.log $dir/$name.log
+	then
+		echo "$name: FAILED"
+		diff $dir/$name.log $tmp/$name.log | head -20
+		fail=1
+	else
+		echo "$name: ok"
+	fi
+done <<EOF
+basic|-G 30 -J 20000|-b state
+levels|-G 30 -J 20000|-b state -l 1 -L 1
+qos|-G 30 -J 20000|-b qos
+dma|-G 30 -J 20000|-a
+missing|-G 30 -M 7|-b state
+holdover|-G 30 -M 7|-b state -o 3
+step|-G 30 -X 15:5000000|-b state
+adaptive|-G 120 -J 20000|-b state -A 95
+EOF
+
+exit $fail
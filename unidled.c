@@ -19,7 +19,7 @@
  *
  * Compile and link:
  *
- * gcc -Wall -O3 -s -o unidled unidled.c -lrt
+ * gcc -Wall -O3 -s -o unidled unidled.c -lrt -lpthread
  *
  * Using gpsd (gps with pps attached) and unidled in combination with chronyd
  * (SOCK refclock) results in a average input deviation well below 1us according
@@ -28,34 +28,66 @@
  *
  * The default is for systems using the intel_idle driver, the "-a" option
  * uses the generic idle management method and should work for all other
- * systems.
+ * systems. In single core mode the resume latency pm qos of the core is
+ * used if available, otherwise its idle state disable files (see "-b").
+ *
+ * The pulse edge is tracked by a software pll fed with the kernel pps
+ * timestamps and the poll mode windows are armed as absolute times derived
+ * from it, thus a late wakeup does not move them. Up to 8 pps devices or
+ * 1Hz udp events ("-u", e.g. ptp sync messages), each on its own cores,
+ * are handled by one daemon, pps devices created or removed later on are
+ * attached and detached as they come and go.
+ *
+ * Compiled with "-DSIMULATE" unidled replays pps traces against a fake
+ * sysfs root and a virtual clock, logs every idle control write to stdout
+ * and checks the resulting poll time, e.g.:
+ *
+ * gcc -Wall -O2 -DSIMULATE -o unidled-sim unidled.c -lrt -lpthread
+ * mkdir -p root/dev
+ * for i in 0 1 2 3; do d=root/sys/devices/system/cpu/cpu0/cpuidle/state$i
+ *	mkdir -p $d; echo 0 > $d/disable; echo $((i*40)) > $d/latency; done
+ * ./unidled-sim -G 60 -J 2000 -M 17 -E ca > trace
+ * ./unidled-sim -R root -d trace -l 2 -L 3 > writes
  *
  * For a list of all options, run "unidled -h".
  *
  * When using unidled, assert that all of gpsd, chronyd and unidled are set
  * to run on the same core and with realtime privilege (unidled highest,
- * followed by gpsd and then chronyd whith lowest privilege). Make sure that
- * the pps serial interrupt is served by the same core, use a script to
- * irqbalance to assert this, if required.
+ * followed by gpsd and then chronyd whith lowest privilege), "-g" and "-I"
+ * take care of this for the daemons and the pps serial interrupt.
  *
  * When using the chronyd SOCK refclock the daemon start sequence is first
- * chronyd, then gpsd (requires chronyd socket) and finally unidled (requires
- * pps device created by gpsd).
+ * chronyd and then gpsd (requires chronyd socket), unidled can be started
+ * at any time.
  */
 
 #define _GNU_SOURCE
 #include <linux/types.h>
 #include <linux/pps.h>
+#include <linux/netlink.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <time.h>
 #include <errno.h>
 #include <sched.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
@@ -78,31 +110,444 @@
 
 #define PPSCAPS (PPS_CAPTUREBOTH|PPS_CANWAIT)
 
-struct common
+#define MAXUNITS	8
+#define MAXCORES	64
+
+#define LVL_ALL		0
+#define LVL_LOW		1
+#define LVL_POLL	2
+
+#define ARM_RESET	-1LL
+
+#define EV_TIMER	0
+#define EV_PPS		1
+#define EV_WATCH	2
+#define EV_PIPE		3
+#define EV_SIGNAL	4
+#define EV_STOP		5
+#define EV_CTL		6
+#define EV_METER	7
+#define EV_UEVENT	8
+#define EV_CHECK	9
+#define EV_NET		10
+#define EV_QUIET	11
+#define EVMAX		16
+
+#define ADBINS		4096
+#define ADDECAY		256
+#define ADMIN		20000
+#define ADMARGIN	10000
+
+#define LHSUB		5
+#define LHBINS		((26<<LHSUB)+(1<<LHSUB))
+#define LHMAX		((1LL<<31)-1)
+
+#define SHMMAGIC	0x756e6964
+#define SHMVERS		7
+
+#define WIDTHINT	64
+#define WIDTHMAX	500000000
+
+#define CHECKINT	10
+
+#define MAXTASKS	8
+
+#define HOLDMIN		16
+#define HOLDSPAN	64
+
+#define PLLKP		4
+#define PLLKI		64
+#define PLLMAX		5000000LL
+
+#define SCHEDS		8
+#define MAXZONES	8
+
+#define RINGMAGIC	0x756e6972
+#define RINGVERS	1
+#define RINGMIN		1024
+#define RINGMAX		268435456
+#define RINGDEF		1048576
+
+#ifdef SIMULATE
+#define SIMLAT		20000LL
+#define SIMTMO		1100000000LL
+#define SIMTAIL		2200000000LL
+#define SIMOPTS		"G:J:W:E:M:X:"
+#define SIMUSAGE \
+	"\nSimulation (-R is mandatory, -d <trace> replays a pps trace):\n\n" \
+	"-G <seconds>	write a generated trace to stdout\n" \
+	"-J <nanosecs>	generated pulse jitter (0-100000000, 0 default)\n" \
+	"-W <millisecs>	generated pulse width (1-900, 100 default)\n" \
+	"-E <edges>	generated edges, a, c, ac or ca (ac default)\n" \
+	"-M <n>		drop every nth generated pulse\n" \
+	"-X <sec>:<ns>	step the realtime clock by <ns> before second <sec>\n" \
+	"\nTrace lines are 'a <ns> [<latency>]' and 'c <ns> [<latency>]' for\n" \
+	"pulse edges and 's <ns> <delta>' for realtime clock steps. Writes go\n" \
+	"to stdout, the exit status is 1 if the poll mode time exceeds the\n" \
+	"configured windows.\n"
+#else
+#define SIMOPTS		""
+#define SIMUSAGE	""
+#endif
+
+struct tstat
 {
-	int state;
+	unsigned long cnt;
+	long long sum;
+	long min;
+	long max;
+};
+
+struct idle
+{
+	int cpu;
+	int qos;
 	int max;
 	int high;
+	int thres;
+	int level;
+	int req[3];
+	int fd[32];
+	long long stamp;
+	long long since;
+	long long dwell[3];
+	pthread_mutex_t mtx;
+	struct tstat ts[3];
+	struct lhist *cost;
+};
+
+struct shmpps
+{
+	unsigned int seq;
+	int locked;
+	unsigned long pulses;
+	unsigned long rejected;
+	unsigned long timeouts;
+	unsigned long relocks;
+	unsigned long resets;
+	unsigned long attached;
+	unsigned long wbad;
+	long width;
+	long steer;
+	struct tstat serr;
+} __attribute__((aligned(64)));
+
+struct shmtimer
+{
+	unsigned int seq;
+	unsigned long switches;
+	unsigned long failed;
+	unsigned long holdover;
+	unsigned long degraded;
+	long last;
+	struct tstat late;
+} __attribute__((aligned(64)));
+
+struct shmunit
+{
+	char dev[64];
+	int cpu;
+	int irq;
+	unsigned long irqfix;
+	struct shmpps pps;
+	struct shmtimer tmr;
+};
+
+struct shmstat
+{
+	unsigned int magic;
+	unsigned int version;
+	int pid;
+	int units;
+	unsigned long moved;
+	struct shmunit unit[MAXUNITS];
+};
+
+struct rhdr
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;
+	unsigned int entries;
+	unsigned long long head;
+} __attribute__((aligned(64)));
+
+struct rrec
+{
+	unsigned int nr;
+	unsigned char unit;
+	unsigned char type;
+	unsigned char level;
+	unsigned char res;
+	unsigned int aseq;
+	unsigned int cseq;
+	long long mono;
+	long long raw;
+	long long real;
+	long long assert;
+	long long clear;
+} __attribute__((packed));
+
+struct lhist
+{
+	unsigned long total;
+	long long max;
+	unsigned long bin[LHBINS];
+};
+
+struct hist
+{
+	unsigned int total;
+	unsigned int bin[ADBINS];
+};
+
+struct tune
+{
+	int thres;
+	int poh;
+	int pof;
+	int prf;
+	int prh;
+	int all;
+	int qos;
+};
+
+struct rcore
+{
+	int cpu;
+	int n;
+	int grp;
+	int ngrp;
+	int ufd[32];
+	int tfd[32];
+	unsigned long long usage[32];
+	unsigned long long time[32];
+	char sname[32][16];
+};
+
+struct rzone
+{
+	int fd;
+	unsigned long long max;
+	unsigned long long last;
+};
+
+struct sched
+{
+	char label[64];
+	int ncpu;
+	long long dur;
+	unsigned long long energy;
+	unsigned long long usage[MAXCORES][32];
+	unsigned long long time[MAXCORES][32];
+};
+
+struct task
+{
+	char *name;
+	int pid;
+	int prio;
+};
+
+struct fmsg
+{
+	int timeout;
+	long long now;
+	long long rt;
+	struct pps_kinfo info;
+};
+
+struct common;
+
+struct unit
+{
+	int cpu;
+	int ncpu;
+	int nidle;
+	int state;
 	int first;
+	int level;
+	int tfd;
+	int wfd;
+	int epfd;
+	int ppsfd;
+	int pfd[2];
+	int prf;
+	int pof;
+	int wprf;
+	int tprf;
+	int tpof;
+	int tprl;
+	int miss;
+	int hold;
+	int hcnt;
+	int gone;
+	int net;
+	int port;
+	unsigned int group;
+	int irq;
+	int irqset;
+	unsigned int aseq;
+	unsigned int cseq;
+	unsigned long cycle;
+	unsigned int eseq;
+	int sample;
+	int wcnt;
+	char *dev;
+	char pps[32];
+	long long arm;
+	long long at;
+	long long base;
+	long long phi;
+	long long per;
+	long long jit;
+	long long hper;
+	long long hdev;
+	long long win;
+	long long pstart;
+	long long evlast;
+	pthread_t tid;
+	pthread_t fid;
+	int cpus[MAXCORES];
+	struct idle *idle[MAXCORES];
+	struct common *c;
+	struct shmunit *sh;
+	struct tstat wpre;
+	struct tstat wpost;
+	struct tstat wmiss;
+	struct hist pre;
+	struct hist post;
+	struct lhist lat[3];
+#ifdef SIMULATE
+	FILE *trace;
+	int type;
+	long long when;
+	long long delay;
+	long long due;
+	long long fstart;
+	long long edge;
+	long long tail;
+	struct pps_kinfo info;
+#endif
+};
+
+struct common
+{
 	int poh;
 	int pof;
 	int prf;
 	int prh;
 	int prl;
 	int prio;
-	int cpu;
+	int ncpu;
 	int thres;
 	int fg;
 	int all;
-	char *dev;
+	int qos;
+	int units;
+	int idles;
+	int hold;
+	int edge;
+	int efd;
+	int sfd;
+	int ctl;
+	int nlfd;
+	int iprio;
+	int cfd;
+	int cdue;
+	int tasks;
+	int tset;
+	struct task task[MAXTASKS];
+	int pend;
+	unsigned long pcycle;
+	char *sock;
+	char *tell;
+	int cal;
+	int target;
+	int bench;
+	int rate;
+	struct tune next;
+	int quiet;
+	int loops;
+	int parked;
+	int qfd;
+	pthread_mutex_t qmtx;
+	pthread_cond_t qcond;
+	double adapt;
+	int show;
 	char *pid;
-	timer_t id;
-	struct itimerspec it;
+	char *hist;
+	char *shm;
+	char *ring;
+	char *dump;
+	int rents;
+	struct shmstat *stat;
+	struct rhdr *rhdr;
+	struct rrec *rrec;
+	int meter;
+	int mfd;
+	int mdue;
+	int ncores;
+	int nzones;
+	int nsched;
+	long long mlast;
+	int ngrps;
+	struct rcore core[MAXCORES];
+	struct rzone zone[MAXZONES];
+	struct sched sched[SCHEDS];
+#ifdef SIMULATE
+	int gen;
+	int jitter;
+	int width;
+	int miss;
+	int stepat;
+	long long step;
+	char *edges;
+#endif
+	int cpus[MAXCORES];
+	struct unit unit[MAXUNITS];
+	struct idle idle[MAXCORES];
 };
 
 static int doterm;
-static char idlelist[32][64];
-static int idlefd[32];
+static char *root="";
+static char idlelist[32][256];
+static int qoslen[3];
+static char qosval[3][16];
+
+#ifdef SIMULATE
+
+static long long vclock;
+static long long voff;
+
+static COLD ssize_t ctlwrite(int fd,const void *buf,size_t len)
+{
+	int l;
+	int n;
+	char bfr[512];
+	char link[32];
+
+	/* log "<virtual time> <file below root> <value>" */
+
+	sprintf(link,"/proc/self/fd/%d",fd);
+	if((l=readlink(link,bfr,sizeof(bfr)-1))<0)l=0;
+	bfr[l]=0;
+	n=strlen(root);
+	printf("%lld.%09lld %s ",vclock/1000000000,vclock%1000000000,
+		n>1&&!strncmp(bfr,root,n)?bfr+n:bfr);
+	if(l>=15&&!strcmp(bfr+l-15,"cpu_dma_latency")&&len==sizeof(int))
+		printf("%d\n",*(int *)buf);
+	else
+	{
+		fwrite(buf,1,len,stdout);
+		if(!len||((char *)buf)[len-1]!='\n')putchar('\n');
+	}
+	return write(fd,buf,len);
+}
+
+#else
+#define ctlwrite write
+#endif
 
 static COLD int getlimit(int cpu,int max,int thres,int *high)
 {
@@ -110,15 +555,15 @@ static COLD int getlimit(int cpu,int max,int thres,int *high)
 	int fd;
 	long val;
 	char *end;
-	char bfr[64];
+	char bfr[256];
 
 	if(cpu<0||cpu>=1024)return -1;
 
 	for(*high=0,i=0;i<max;i++)
 	{
 		sprintf(bfr,
-			"/sys/devices/system/cpu/cpu%d/cpuidle/state%d/latency",
-			cpu,i);
+			"%s/sys/devices/system/cpu/cpu%d/cpuidle/state%d/latency",
+			root,cpu,i);
 		if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)break;
 		val=read(fd,bfr,sizeof(bfr)-1);
 		close(fd);
@@ -141,7 +586,8 @@ static COLD int buildlist(int cpu,int *max)
 	if(cpu<0||cpu>=1024)return -1;
 
 	for(*max=0,i=0;i<32;i++)sprintf(idlelist[i],
-		"/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable",cpu,i);
+		"%s/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable",
+		root,cpu,i);
 	for(i=0;i<32;i++)if(!stat(idlelist[i],&stb)&&S_ISREG(stb.st_mode))
 		*max=i+1;
 	else break;
@@ -149,32 +595,61 @@ static COLD int buildlist(int cpu,int *max)
 	return 0;
 }
 
-static COLD int openidle(int max)
+static COLD int openidle(int max,int *fd)
 {
 	int i;
+	char bfr[256];
 
 	if(!max)
 	{
-		if((idlefd[0]=open("/dev/cpu_dma_latency",
-			O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)return -1;
+		sprintf(bfr,"%s/dev/cpu_dma_latency",root);
+		if((fd[0]=open(bfr,O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)
+			return -1;
 	}
 	else for(i=0;i<max;i++)
-	    if((idlefd[i]=open(idlelist[i],O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)
+	    if((fd[i]=open(idlelist[i],O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)
 	{
-		while(--i>=0)close(idlefd[i]);
+		while(--i>=0)close(fd[i]);
 		return -1;
 	}
 	return 0;
 }
 
-static COLD void closeidle(int max)
+static COLD void closeidle(int max,int *fd)
 {
 	int i;
 
-	if(!max)close(idlefd[0]);
-	for(i=0;i<max;i++)close(idlefd[i]);
+	if(!max)close(fd[0]);
+	for(i=0;i<max;i++)close(fd[i]);
+}
+
+static COLD int openqos(int cpu,int thres,int *fd)
+{
+	char bfr[256];
+
+	if(cpu<0||cpu>=1024)return -1;
+
+	sprintf(bfr,
+		"%s/sys/devices/system/cpu/cpu%d/power/pm_qos_resume_latency_us",
+		root,cpu);
+	if((*fd=open(bfr,O_WRONLY|O_NONBLOCK|O_CLOEXEC))==-1)return -1;
+
+	/* since 4.14 0 is "no constraint" and "n/a" forces poll */
+
+	qoslen[LVL_ALL]=sprintf(qosval[LVL_ALL],"0\n");
+	qoslen[LVL_LOW]=sprintf(qosval[LVL_LOW],"%d\n",thres);
+	qoslen[LVL_POLL]=sprintf(qosval[LVL_POLL],"n/a\n");
+	if(ctlwrite(*fd,qosval[LVL_POLL],qoslen[LVL_POLL])!=qoslen[LVL_POLL]||
+	    ctlwrite(*fd,qosval[LVL_ALL],qoslen[LVL_ALL])!=qoslen[LVL_ALL])
+	{
+		close(*fd);
+		return -1;
+	}
+	return 0;
 }
 
+#ifndef SIMULATE
+
 static COLD int setcpu(int cpu)
 {
 	cpu_set_t set;
@@ -199,7 +674,7 @@ static COLD int setprio(int prio)
 	return 0;
 }
 
-static COLD int openpps(char *dev)
+static COLD int openpps(char *dev,int edge,char *name)
 {
 	int r=-1;
 	int fd;
@@ -212,10 +687,11 @@ static COLD int openpps(char *dev)
 
 	if(!dev||!*dev)return -1;
 
-	if(!(d=opendir("/sys/class/pps")))return -1;
+	sprintf(bfr,"%s/sys/class/pps",root);
+	if(!(d=opendir(bfr)))return -1;
 	while((e=readdir(d)))if(!strncmp(e->d_name,"pps",3))
 	{
-		sprintf(bfr,"/sys/class/pps/%s/path",e->d_name);
+		sprintf(bfr,"%s/sys/class/pps/%s/path",root,e->d_name);
 		if(!stat(bfr,&stb)&&S_ISREG(stb.st_mode))
 			if((fd=open(bfr,O_RDONLY|O_CLOEXEC))!=-1)
 		{
@@ -228,7 +704,7 @@ static COLD int openpps(char *dev)
 			close(fd);
 			if(!strcmp(bfr,dev))
 			{
-				sprintf(bfr,"/dev/%s",e->d_name);
+				sprintf(bfr,"%s/dev/%s",root,e->d_name);
 				if((r=open(bfr,O_RDWR|O_CLOEXEC))!=-1)
 				{
 					if(ioctl(r,PPS_GETCAP,&l))goto fail;
@@ -236,7 +712,10 @@ static COLD int openpps(char *dev)
 					if(ioctl(r,PPS_GETPARAMS,&prm))goto fail;
 					if(prm.api_version!=PPS_API_VERS)
 						goto fail;
-					prm.mode|=PPS_CAPTUREBOTH;
+					prm.mode&=~PPS_CAPTUREBOTH;
+					prm.mode|=edge==1?PPS_CAPTUREASSERT:
+						edge==2?PPS_CAPTURECLEAR:
+						PPS_CAPTUREBOTH;
 					prm.mode&=
 					    ~(PPS_OFFSETASSERT|PPS_OFFSETCLEAR);
 					memset(&prm.assert_off_tu,0,
@@ -250,6 +729,7 @@ static COLD int openpps(char *dev)
 fail:					close(r);
 					r=-1;
 				}
+				if(r!=-1&&name)sprintf(name,"%.31s",e->d_name);
 				break;
 			}
 		}
@@ -259,36 +739,99 @@ fail:					close(r);
 	return r;
 }
 
-static COLD void term(int unused)
+static COLD int opennet(struct unit *u)
+{
+	int fd;
+	int on=1;
+	struct sockaddr_in addr;
+	struct ip_mreqn mreq;
+
+	if((fd=socket(AF_INET,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0))==-1)
+		return -1;
+
+	/* ptp4l sets SO_REUSEADDR, too, thus multicast is received by both */
+
+	if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on))||
+	    setsockopt(fd,SOL_SOCKET,SO_TIMESTAMPNS,&on,sizeof(on)))goto fail;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(u->port);
+	addr.sin_addr.s_addr=u->group?u->group:htonl(INADDR_ANY);
+	if(bind(fd,(struct sockaddr *)&addr,sizeof(addr)))goto fail;
+
+	if(u->group)
+	{
+		memset(&mreq,0,sizeof(mreq));
+		mreq.imr_multiaddr.s_addr=u->group;
+		if(setsockopt(fd,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreq,
+			sizeof(mreq)))goto fail;
+	}
+	return fd;
+
+fail:	close(fd);
+	return -1;
+}
+
+static COLD int opensrc(struct unit *u)
+{
+	if(u->net)return opennet(u);
+	return openpps(u->dev,u->c->edge,u->pps);
+}
+
+static COLD void wake(int unused)
 {
-	doterm=1;
 }
 
 static COLD void setsigs(void)
 {
 	sigset_t set;
+	struct sigaction sa;
 
 	sigfillset(&set);
-	sigdelset(&set,SIGINT);
-	sigdelset(&set,SIGTERM);
-	sigdelset(&set,SIGHUP);
-	sigdelset(&set,SIGQUIT);
 	sigprocmask(SIG_BLOCK,&set,NULL);
-	signal(SIGINT,term);
-	signal(SIGTERM,term);
-	signal(SIGHUP,term);
-	signal(SIGQUIT,term);
+
+	/* used to interrupt PPS_FETCH of the pps threads on termination */
+
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler=wake;
+	sigaction(SIGUSR1,&sa,NULL);
 }
 
+#endif
+
 static NORETURN COLD void usage(void)
 {
 	fprintf(stderr,
-	"Usage: unidled -d <device> [options]\n"
+	"Usage: unidled -d <device>[:<cores>] [-d ...] [options]\n"
+	"       unidled -u [<group>/]<port>[:<cores>] [-u ...] [options]\n"
+	"       unidled -s [-S <name>]\n"
+	"       unidled -D <file>\n"
+	"       unidled -C <socket> -T <settings>\n"
+	"       unidled -d <device>[:<cores>] -K <pulses>:<nanosecs> [options]\n"
+	"       unidled -B <seconds>[:<rate>] [options]\n"
 	"       unidled -h\n\n"
-	"-d <device> is the serial device the pps signal is attached to.\n"
+	"-d <device> is the serial device the pps signal is attached to,\n"
+	"   optionally followed by the cores to be used for this device.\n"
+	"   Up to 8 devices can be specified.\n"
+	"-u <port> receives one event per second on the given udp port\n"
+	"   (optionally joining a multicast group) instead of a pps device,\n"
+	"   e.g. 224.0.1.129/319 for ptp sync messages. Can be combined\n"
+	"   with -d, up to 8 in total. Only 1Hz sources are supported,\n"
+	"   events less than 0.6s apart are rejected. On port 319 only\n"
+	"   ptp sync messages are used.\n"
+	"-s displays the counters of a running daemon.\n"
+	"-D prints the pps events recorded to the given file as text.\n"
+	"-T sends settings (e.g. \"t=20 p=2 b=state\", \"\" to query) to a\n"
+	"   running daemon and prints the reply.\n"
+	"-K measures pps jitter and wakeup latency over the given pulses\n"
+	"   while disabling one idle state after the other and recommends\n"
+	"   the -t value meeting the given 99th percentile jitter.\n"
+	"-B runs the idle phases at a synthetic pulse rate (1-1000Hz, 1\n"
+	"   default) and prints backend cost and timer lateness.\n"
 	"-h displays this help text.\n\n"
 	"Options are:\n\n"
-	"-c <core>	the core to be used (0-1023)\n"
+	"-c <cores>	the default core list to be used (0-1023, e.g. 2,4-5)\n"
 	"-r <prio>	the realtime priority (1-99)\n"
 	"-t <latency>	the lower latency threshold (1-1000, 50us default)\n"
 	"-P <millisecs>	the post pps pulse poll mode time (1-1000, 1 default)\n"
@@ -298,22 +841,84 @@ static NORETURN COLD void usage(void)
 	"-L <millisecs>	the pre poll mode lower latency time"
 	" (0-1000, 0 default)\n"
 	"-a		modify all cores instead of single core\n"
+	"-b <backend>	single core backend, 'qos' (resume latency) or\n"
+	"		'state' (idle state disable), default 'qos' if available\n"
 	"-f <pidfile>	the pid file (default /run/unidled.pid)\n"
-	"-n		don't daemonize\n");
+	"-A <percentile>	adapt poll mode windows to cover the given percentile\n"
+	"		of pulses (50-100, windows given are the upper limits)\n"
+	"-o <seconds>	keep scheduling poll mode windows on predicted pulses\n"
+	"		for up to the given missing pulses (0-3600, 0 default),\n"
+	"		ending early when the pll error exceeds half a window\n"
+
+	"-e <edge>	capture only the on time edge, 'assert' or 'clear'\n"
+	"		(both edges every 64 pulses to check the pulse width)\n"
+
+	"-H <file>	file to dump the pps latency percentiles to on SIGUSR2\n"
+	"-S <name>	shared memory statistics segment (default /unidled)\n"
+	"-w <file>[:<n>]	record every pps event to a ring of <n> records in\n"
+	"		the given file (1024-268435456, 1048576 default)\n"
+	"-C <socket>	control socket for runtime settings of -t, -p, -P, -l,\n"
+	"		-L, -a and -b (absolute path), applied once no poll\n"
+	"		mode window is open\n"
+
+	"-m <seconds>	sample idle state residency and package energy at the\n"
+	"		given interval (1-3600) and report them per schedule\n"
+	"-I <prio>	pin the serial interrupt of the pps devices to their\n"
+	"		core and run its irq thread at the given realtime\n"
+	"		priority (1-99), checked every 10 seconds\n"
+	"-g <task>[:<prio>] keep the processes with the given name or pid\n"
+	"		on the device cores at the given realtime priority\n"
+	"		(1-99, default -r minus position), up to 8 times. Only\n"
+	"		affinity and priority are set, other workloads are not\n"
+	"		kept off the device cores\n"
+	"-R <root>	root directory prefixed to all /sys, /proc and /dev paths\n"
+	"-n		don't daemonize\n" SIMUSAGE);
 	exit(1);
 }
 
+static COLD int cpulist(char *str,int *list)
+{
+	int i;
+	int n=0;
+	long v;
+	long e;
+	char *end;
+
+	while(1)
+	{
+		v=strtol(str,&end,10);
+		if(str==end||v<0||v>1023)return -1;
+		e=v;
+		if(*end=='-')
+		{
+			str=end+1;
+			e=strtol(str,&end,10);
+			if(str==end||e<v||e>1023)return -1;
+		}
+		for(;v<=e;v++)
+		{
+			for(i=0;i<n;i++)if(list[i]==v)break;
+			if(i<n)continue;
+			if(n==MAXCORES)return -1;
+			list[n++]=(int)v;
+		}
+		if(!*end)return n;
+		if(*end!=',')return -1;
+		str=end+1;
+	}
+}
+
 static COLD void parse(int argc,char *argv[],struct common *c)
 {
 	int x;
 	long v;
 	char *end;
+	char *core;
 	struct stat stb;
 
-	c->first=1;
-	c->state=0;
 	c->prio=1;
-	c->cpu=0;
+	c->ncpu=1;
+	c->cpus[0]=0;
 	c->thres=50;
 	c->pof=1;
 	c->poh=0;
@@ -321,15 +926,59 @@ static COLD void parse(int argc,char *argv[],struct common *c)
 	c->prf=1;
 	c->fg=0;
 	c->all=0;
-	c->dev=NULL;
+	c->qos=-1;
+	c->units=0;
+	c->idles=0;
+	c->adapt=0;
+	c->hold=0;
+	c->edge=0;
 	c->pid="/run/unidled.pid";
+	c->hist=NULL;
+#ifdef SIMULATE
+	c->shm=NULL;
+	c->gen=0;
+	c->jitter=0;
+	c->width=100000000;
+	c->miss=0;
+	c->stepat=0;
+	c->step=0;
+	c->edges="ac";
+#else
+	c->shm="/unidled";
+#endif
+	c->show=0;
+	c->ring=NULL;
+	c->dump=NULL;
+	c->rents=RINGDEF;
+	c->rhdr=NULL;
+	c->ctl=-1;
+	c->nlfd=-1;
+	c->iprio=0;
+	c->cfd=-1;
+	c->cdue=0;
+	c->tasks=0;
+	c->tset=0;
+	c->pend=0;
+	c->sock=NULL;
+	c->tell=NULL;
+	c->cal=0;
+	c->target=0;
+	c->bench=0;
+	c->rate=1;
+	c->meter=0;
+	c->mfd=-1;
+	c->mdue=0;
+	c->quiet=0;
+	c->loops=0;
+	c->parked=0;
+	c->qfd=-1;
 
-	while((x=getopt(argc,argv,"c:r:d:t:P:p:L:l:f:nah"))!=-1)switch(x)
+	while((x=getopt(argc,argv,
+		"c:r:d:u:t:P:p:L:l:f:b:A:o:e:H:S:R:w:D:C:T:K:B:I:g:m:" SIMOPTS
+		"snah"))!=-1)switch(x)
 	{
 	case 'c':
-		v=strtol(optarg,&end,10);
-		if(optarg==end||*end||v<0||v>1023)usage();
-		c->cpu=(int)v;
+		if((c->ncpu=cpulist(optarg,c->cpus))==-1)usage();
 		break;
 
 	case 'r':
@@ -339,9 +988,52 @@ static COLD void parse(int argc,char *argv[],struct common *c)
 		break;
 
 	case 'd':
+		if(c->units==MAXUNITS)usage();
+		c->unit[c->units].ncpu=0;
+		if((core=strrchr(optarg,':')))
+		{
+			*core++=0;
+			if((c->unit[c->units].ncpu=
+				cpulist(core,c->unit[c->units].cpus))==-1)
+				usage();
+		}
+#ifdef SIMULATE
+		if(!*optarg||stat(optarg,&stb)||!S_ISREG(stb.st_mode))usage();
+#else
 		if(!*optarg||stat(optarg,&stb)||!S_ISCHR(stb.st_mode))usage();
-		c->dev=optarg;
+#endif
+		c->unit[c->units].net=0;
+		c->unit[c->units++].dev=optarg;
+		break;
+
+#ifndef SIMULATE
+	case 'u':
+		if(c->units==MAXUNITS)usage();
+		c->unit[c->units].ncpu=0;
+		if((core=strrchr(optarg,':')))
+		{
+			*core++=0;
+			if((c->unit[c->units].ncpu=
+				cpulist(core,c->unit[c->units].cpus))==-1)
+				usage();
+		}
+		c->unit[c->units].dev=optarg;
+		c->unit[c->units].group=0;
+		if((core=strchr(optarg,'/')))
+		{
+			*core=0;
+			x=inet_pton(AF_INET,optarg,&c->unit[c->units].group);
+			*core++='/';
+			if(x!=1||!IN_MULTICAST(ntohl(c->unit[c->units].group)))
+				usage();
+		}
+		else core=optarg;
+		v=strtol(core,&end,10);
+		if(core==end||*end||v<1||v>65535)usage();
+		c->unit[c->units].port=(int)v;
+		c->unit[c->units++].net=1;
 		break;
+#endif
 
 	case 't':
 		v=strtol(optarg,&end,10);
@@ -378,158 +1070,3237 @@ static COLD void parse(int argc,char *argv[],struct common *c)
 		c->pid=optarg;
 		break;
 
-	case 'n':
-		c->fg=1;
+	case 'H':
+		if(!*optarg)usage();
+		c->hist=optarg;
 		break;
 
-	case 'a':
-		c->all=1;
+	case 'S':
+		if(*optarg!='/'||!optarg[1]||strchr(optarg+1,'/'))usage();
+		c->shm=optarg;
 		break;
 
-	default:usage();
-	}
+	case 'R':
+		if(!*optarg||strlen(optarg)>128||stat(optarg,&stb)||
+		    !S_ISDIR(stb.st_mode))usage();
+		root=optarg;
+		break;
 
-	if(!c->dev||c->poh+c->pof+c->prf+c->prh>1000)usage();
+#ifdef SIMULATE
+	case 'G':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<1||v>10000000)usage();
+		c->gen=(int)v;
+		break;
 
-	c->poh*=1000000;
-	c->pof*=1000000;
-	c->prf*=1000000;
-	c->prh*=1000000;
-	c->prl=1000000000-c->pof-c->poh-c->prh-c->prf;
-	memset(&c->it,0,sizeof(c->it));
-}
+	case 'J':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<0||v>100000000)usage();
+		c->jitter=(int)v;
+		break;
 
-static HOT int modify(int base,int total,int mode)
-{	       
-	for(;base<total;base++)
-	{
-		if(UNLIKELY(write(idlefd[base],mode?"1\n":"0\n",2)!=2))
-			return -1;
-	}
-	return 0;
-}	       
+	case 'W':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<1||v>900)usage();
+		c->width=(int)v*1000000;
+		break;
 
-static HOT int idleset(int val)
-{
-	if(UNLIKELY(write(idlefd[0],&val,sizeof(val))!=sizeof(val)))return -1;
-	return 0;
-}
+	case 'E':
+		if(strcmp(optarg,"a")&&strcmp(optarg,"c")&&
+		    strcmp(optarg,"ac")&&strcmp(optarg,"ca"))usage();
+		c->edges=optarg;
+		break;
 
-static HOT void timer(union sigval param)
-{
-	struct common *c=param.sival_ptr;
+	case 'M':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<1)usage();
+		c->miss=(int)v;
+		break;
 
-	if(LIKELY(!c->first))switch(c->state++)
-	{
-	case 0:	if(!c->poh)c->state++;
-		else
+	case 'X':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end!=':'||v<1||v>10000000)usage();
+		c->stepat=(int)v;
+		optarg=end+1;
+		c->step=strtoll(optarg,&end,10);
+		if(optarg==end||*end)usage();
+		break;
+#endif
+
+	case 'w':
+		if((core=strrchr(optarg,':')))
 		{
-			c->it.it_value.tv_nsec=c->poh;
-			timer_settime(c->id,0,&c->it,NULL);
-			if(c->all)idleset(c->thres);
-			else modify(1,c->high,0);
-			break;
+			*core++=0;
+			v=strtol(core,&end,10);
+			if(core==end||*end||v<RINGMIN||v>RINGMAX)usage();
+			c->rents=(int)v;
 		}
+		if(!*optarg)usage();
+		c->ring=optarg;
+		break;
 
-	case 1:	if(!c->prl)c->state++;
-		else
+	case 'D':
+		if(!*optarg)usage();
+		c->dump=optarg;
+		break;
+
+#ifndef SIMULATE
+	case 'C':
+		if(*optarg!='/'||strlen(optarg)>=sizeof(((struct sockaddr_un *)
+			NULL)->sun_path))usage();
+		c->sock=optarg;
+		break;
+
+	case 'T':
+		c->tell=optarg;
+		break;
+
+	case 'I':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<1||v>99)usage();
+		c->iprio=(int)v;
+		break;
+
+	case 'g':
+		if(c->tasks==MAXTASKS)usage();
+		c->task[c->tasks].prio=0;
+		if((core=strrchr(optarg,':')))
 		{
-			c->it.it_value.tv_nsec=c->prl;
-			timer_settime(c->id,0,&c->it,NULL);
-			if(c->all)idleset(-1);
-			else modify(c->poh?c->high:1,c->max,0);
-			break;
+			*core++=0;
+			v=strtol(core,&end,10);
+			if(core==end||*end||v<1||v>99)usage();
+			c->task[c->tasks].prio=(int)v;
+		}
+		if(!*optarg||strlen(optarg)>15)usage();
+		v=strtol(optarg,&end,10);
+		if(optarg!=end&&!*end&&v>0&&v<=INT_MAX)
+		{
+			c->task[c->tasks].pid=(int)v;
+			c->task[c->tasks].name=NULL;
 		}
-
-	case 2:	if(!c->prh)c->state++;
 		else
 		{
-			c->it.it_value.tv_nsec=c->prh;
-			timer_settime(c->id,0,&c->it,NULL);
-			if(c->all)idleset(c->thres);
-			else modify(c->high,c->max,1);
-			break;
+			c->task[c->tasks].pid=0;
+			c->task[c->tasks].name=optarg;
 		}
+		c->tasks++;
+		break;
+
+	case 'K':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end!=':'||v<16||v>86400)usage();
+		c->cal=(int)v;
+		optarg=end+1;
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<1||v>100000000)usage();
+		c->target=(int)v;
+		break;
 
-	case 3:	if(c->prf)
+	case 'B':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||(*end&&*end!=':')||v<1||v>86400)usage();
+		c->bench=(int)v;
+		if(*end)
 		{
-			c->it.it_value.tv_nsec=c->prf;
-			timer_settime(c->id,0,&c->it,NULL);
-			if(c->all)idleset(0);
-			else modify(1,c->prh?c->high:c->max,1);
+			optarg=end+1;
+			v=strtol(optarg,&end,10);
+			if(optarg==end||*end||v<1||v>1000)usage();
+			c->rate=(int)v;
 		}
 		break;
-	}
-}
+#endif
 
-static COLD int prepare(struct common *c)
-{
-	int i;
-	int fd;
-	struct sigevent sev;
-	FILE *fp;
+	case 's':
+		c->show=1;
+		break;
 
-	setsigs();
+	case 'n':
+		c->fg=1;
+		break;
 
-	if(UNLIKELY(mlockall(MCL_CURRENT|MCL_FUTURE)))
-	{
-		perror("mlockall");
+	case 'a':
+		c->all=1;
+		break;
+
+	case 'b':
+		if(!strcmp(optarg,"qos"))c->qos=1;
+		else if(!strcmp(optarg,"state"))c->qos=0;
+		else usage();
+		break;
+
+	case 'o':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<0||v>3600)usage();
+		c->hold=(int)v;
+		break;
+
+	case 'm':
+		v=strtol(optarg,&end,10);
+		if(optarg==end||*end||v<1||v>3600)usage();
+		c->meter=(int)v;
+		break;
+
+	case 'e':
+		if(!strcmp(optarg,"assert"))c->edge=1;
+		else if(!strcmp(optarg,"clear"))c->edge=2;
+		else usage();
+		break;
+
+	case 'A':
+		c->adapt=strtod(optarg,&end);
+		if(optarg==end||*end||c->adapt<50||c->adapt>100)usage();
+		break;
+
+	default:usage();
+	}
+
+	if(c->tell&&!c->sock)usage();
+	if(c->show||c->dump||c->tell)return;
+
+#ifdef SIMULATE
+	if(c->gen)return;
+	if(!*root||!(root=realpath(root,NULL)))usage();
+#endif
+
+	if(c->bench&&!c->units)
+	{
+		c->unit[0].ncpu=0;
+		c->unit[0].dev="benchmark";
+		c->units=1;
+	}
+
+	if(!c->units||c->poh+c->pof+c->prf+c->prh>1000)usage();
+
+	c->poh*=1000000;
+	c->pof*=1000000;
+	c->prf*=1000000;
+	c->prh*=1000000;
+	c->prl=1000000000-c->pof-c->poh-c->prh-c->prf;
+
+	/* tasks without a priority are ordered below unidled as given */
+
+	for(x=0;x<c->tasks;x++)if(!c->task[x].prio)
+		c->task[x].prio=c->prio-1-x>0?c->prio-1-x:1;
+
+	for(x=0;x<c->units;x++)
+	{
+		if(!c->unit[x].ncpu)
+		{
+			c->unit[x].ncpu=c->ncpu;
+			memcpy(c->unit[x].cpus,c->cpus,sizeof(c->cpus));
+		}
+		c->unit[x].cpu=c->unit[x].cpus[0];
+		c->unit[x].c=c;
+		c->unit[x].first=1;
+		c->unit[x].state=0;
+		c->unit[x].level=LVL_ALL;
+		c->unit[x].ppsfd=-1;
+		c->unit[x].tfd=-1;
+		c->unit[x].wfd=-1;
+		c->unit[x].epfd=-1;
+		c->unit[x].pfd[0]=c->unit[x].pfd[1]=-1;
+		c->unit[x].aseq=c->unit[x].cseq=0;
+		c->unit[x].cycle=0;
+		c->unit[x].eseq=0;
+		c->unit[x].sample=0;
+		c->unit[x].wcnt=0;
+		c->unit[x].arm=0;
+		c->unit[x].at=0;
+		c->unit[x].base=0;
+		c->unit[x].phi=0;
+		c->unit[x].per=1000000000;
+		c->unit[x].jit=0;
+		c->unit[x].hper=0;
+		c->unit[x].hdev=0;
+		c->unit[x].miss=0;
+		c->unit[x].hold=0;
+		c->unit[x].hcnt=0;
+		c->unit[x].gone=0;
+		c->unit[x].evlast=0;
+		c->unit[x].irq=0;
+		c->unit[x].irqset=0;
+		c->unit[x].pps[0]=0;
+		c->unit[x].pstart=0;
+		c->unit[x].prf=c->unit[x].wprf=c->unit[x].tprf=c->prf;
+		c->unit[x].pof=c->unit[x].tpof=c->pof;
+		c->unit[x].tprl=c->prl;
+		c->unit[x].win=((long long)c->prf<<32)|c->pof;
+		memset(&c->unit[x].wpre,0,sizeof(c->unit[x].wpre));
+		memset(&c->unit[x].wpost,0,sizeof(c->unit[x].wpost));
+		memset(&c->unit[x].wmiss,0,sizeof(c->unit[x].wmiss));
+		memset(&c->unit[x].pre,0,sizeof(c->unit[x].pre));
+		memset(&c->unit[x].post,0,sizeof(c->unit[x].post));
+		memset(c->unit[x].lat,0,sizeof(c->unit[x].lat));
+	}
+}
+
+static inline HOT long long mono(void)
+{
+#ifdef SIMULATE
+	return vclock;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return now.tv_sec*1000000000LL+now.tv_nsec;
+#endif
+}
+
+static inline HOT long long real(void)
+{
+#ifdef SIMULATE
+	return vclock+voff;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME,&now);
+	return now.tv_sec*1000000000LL+now.tv_nsec;
+#endif
+}
+
+static inline HOT long long rawmono(void)
+{
+#ifdef SIMULATE
+	return vclock;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW,&now);
+	return now.tv_sec*1000000000LL+now.tv_nsec;
+#endif
+}
+
+static inline HOT void wbegin(unsigned int *seq)
+{
+	__atomic_store_n(seq,*seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline HOT void wend(unsigned int *seq)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(seq,*seq+1,__ATOMIC_RELAXED);
+}
+
+static inline HOT void account(struct tstat *t,long val)
+{
+	if(!t->cnt++||val<t->min)t->min=val;
+	if(val>t->max)t->max=val;
+	t->sum+=val;
+}
+
+static HOT int modify(int *fd,int base,int total,int mode)
+{	       
+	for(;base<total;base++)
+	{
+		if(UNLIKELY(ctlwrite(fd[base],mode?"1\n":"0\n",2)!=2))
+			return -1;
+	}
+	return 0;
+}	       
+
+static HOT int idleset(int fd,int val)
+{
+	if(UNLIKELY(ctlwrite(fd,&val,sizeof(val))!=sizeof(val)))return -1;
+	return 0;
+}
+
+static HOT int qosset(int fd,int level)
+{
+	if(UNLIKELY(ctlwrite(fd,qosval[level],qoslen[level])!=qoslen[level]))
+		return -1;
+	return 0;
+}
+
+static HOT void lhput(struct lhist *h,long long val)
+{
+	int e;
+
+	if(val<0)val=0;
+	else if(val>LHMAX)val=LHMAX;
+	if(val>h->max)h->max=val;
+	h->total++;
+
+	if(val<(2<<LHSUB))h->bin[val]++;
+	else
+	{
+		e=63-__builtin_clzll(val)-LHSUB;
+		h->bin[(e<<LHSUB)+(val>>e)]++;
+	}
+}
+
+static HOT int setlevel(struct idle *t,int level)
+{
+	int r;
+	long long d;
+	long long e;
+
+	if(UNLIKELY(level==t->level))return 0;
+
+	d=mono();
+
+	if(t->cpu==-1)r=idleset(t->fd[0],
+		level==LVL_POLL?0:level==LVL_LOW?t->thres:-1);
+	else if(t->qos)r=qosset(t->fd[0],level);
+	else switch(t->level*3+level)
+	{
+	case LVL_ALL*3+LVL_LOW:
+		r=modify(t->fd,t->high,t->max,1);
+		break;
+	case LVL_ALL*3+LVL_POLL:
+		r=modify(t->fd,1,t->max,1);
+		break;
+	case LVL_LOW*3+LVL_ALL:
+		r=modify(t->fd,t->high,t->max,0);
+		break;
+	case LVL_LOW*3+LVL_POLL:
+		r=modify(t->fd,1,t->high,1);
+		break;
+	case LVL_POLL*3+LVL_ALL:
+		r=modify(t->fd,1,t->max,0);
+		break;
+	default:r=modify(t->fd,1,t->high,0);
+		break;
+	}
+
+	e=mono();
+
+	if(UNLIKELY(r))return -1;
+
+	/* time of change (microseconds), previous and current level */
+
+	__atomic_store_n(&t->stamp,((e/1000)<<4)|(t->level<<2)|level,
+		__ATOMIC_RELEASE);
+	t->dwell[t->level]+=e-t->since;
+	t->since=e;
+	t->level=level;
+	account(&t->ts[level],(long)(e-d));
+	if(UNLIKELY(t->cost!=NULL))lhput(&t->cost[level],e-d);
+	return 0;
+}
+
+static HOT int pulselevel(struct idle *t,long long pulse)
+{
+	long long val;
+
+	val=__atomic_load_n(&t->stamp,__ATOMIC_ACQUIRE);
+	if(pulse/1000>=val>>4)return val&3;
+	return (val>>2)&3;
+}
+
+static HOT void request(struct unit *u,int level)
+{
+	int i;
+	int r=0;
+	struct idle *t;
+
+	if(UNLIKELY(level==u->level))return;
+
+	for(i=0;i<u->nidle;i++)
+	{
+		t=u->idle[i];
+		pthread_mutex_lock(&t->mtx);
+		t->req[u->level]--;
+		t->req[level]++;
+		r|=setlevel(t,t->req[LVL_POLL]?LVL_POLL:
+			t->req[LVL_LOW]?LVL_LOW:LVL_ALL);
+		pthread_mutex_unlock(&t->mtx);
+	}
+	u->level=level;
+
+	if(UNLIKELY(r))
+	{
+		wbegin(&u->sh->tmr.seq);
+		u->sh->tmr.failed++;
+		wend(&u->sh->tmr.seq);
+	}
+}
+
+static HOT long long phase(struct unit *u,long long at)
+{
+	struct common *c=u->c;
+
+	switch(u->state++)
+	{
+	case 0:	if(!c->poh)u->state++;
+		else
+		{
+			request(u,LVL_LOW);
+			return at+c->poh;
+		}
+
+	case 1:	if(!u->tprl)u->state++;
+		else
+		{
+			request(u,LVL_ALL);
+			return at+u->tprl;
+		}
+
+	case 2:	if(!c->prh)u->state++;
+		else
+		{
+			request(u,LVL_LOW);
+			return at+c->prh;
+		}
+
+	case 3:	if(u->tprf)
+		{
+			request(u,LVL_POLL);
+			__atomic_store_n(&u->pstart,mono(),__ATOMIC_RELEASE);
+		}
+
+		/* deadline for holdover if the pulse does not show up */
+
+		if(c->hold&&(at=__atomic_load_n(&u->hper,__ATOMIC_RELAXED)))
+			return u->base+at;
+		break;
+	}
+	return 0;
+}
+
+static HOT void settimer(struct unit *u,long long at)
+{
+#ifdef SIMULATE
+	u->due=at>0?at:vclock;
+#else
+	struct itimerspec it;
+
+	memset(&it,0,sizeof(it));
+	if(at>0)
+	{
+		it.it_value.tv_sec=at/1000000000;
+		it.it_value.tv_nsec=at%1000000000;
+	}
+	else it.it_value.tv_nsec=1;
+	timerfd_settime(u->tfd,TFD_TIMER_ABSTIME,&it,NULL);
+#endif
+}
+
+static HOT void arm(struct unit *u,long long at)
+{
+	__atomic_store_n(&u->arm,at,__ATOMIC_SEQ_CST);
+	settimer(u,at);
+}
+
+static HOT int holdover(struct unit *u)
+{
+	int pof;
+	long long err;
+	struct common *c=u->c;
+
+	/* mean pll edge error grown over the gap versus the smallest window */
+
+	pof=u->tpof;
+	if(u->tprf&&u->tprf<pof)pof=u->tprf;
+	err=__atomic_load_n(&u->hdev,__ATOMIC_RELAXED)*(u->miss+2);
+
+	account(&u->wmiss,mono()-__atomic_load_n(&u->pstart,__ATOMIC_ACQUIRE));
+
+	if(++u->miss>c->hold||err>pof/2)
+	{
+		request(u,LVL_ALL);
+		u->at=0;
+		__atomic_store_n(&u->hold,-1,__ATOMIC_RELEASE);
+		wbegin(&u->sh->tmr.seq);
+		u->sh->tmr.degraded++;
+		wend(&u->sh->tmr.seq);
+		return -1;
+	}
+
+	__atomic_store_n(&u->hold,1,__ATOMIC_RELEASE);
+	u->base=u->at;
+	u->state=0;
+	wbegin(&u->sh->tmr.seq);
+	u->sh->tmr.holdover++;
+	wend(&u->sh->tmr.seq);
+	return 0;
+}
+
+static HOT void expire(struct unit *u,long long now)
+{
+	long long val;
+
+	if(UNLIKELY((val=__atomic_load_n(&u->arm,__ATOMIC_SEQ_CST))))
+	{
+		if(val>now||!__atomic_compare_exchange_n(&u->arm,&val,0,
+		    0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))
+		{
+			settimer(u,val);
+			return;
+		}
+
+		if(val==ARM_RESET)
+		{
+			request(u,LVL_ALL);
+			u->at=0;
+			return;
+		}
+
+		u->at=u->base=val;
+		u->cycle++;
+		u->miss=0;
+		__atomic_store_n(&u->hold,0,__ATOMIC_RELEASE);
+		val=__atomic_load_n(&u->win,__ATOMIC_SEQ_CST);
+		u->tprf=(int)(val>>32);
+		u->tpof=(int)(val&0xffffffff);
+
+		/* the next pre pulse windows are placed by the pll period */
+
+		u->tprl=(int)(__atomic_load_n(&u->per,__ATOMIC_RELAXED)-
+			u->tpof-u->c->poh-u->c->prh-u->tprf);
+		u->state=0;
+	}
+	else if(UNLIKELY(!u->at))return;
+	else if(UNLIKELY(u->state==4)&&holdover(u))return;
+
+	wbegin(&u->sh->tmr.seq);
+	u->sh->tmr.switches++;
+	u->sh->tmr.last=(long)(now-u->at);
+	account(&u->sh->tmr.late,u->sh->tmr.last);
+	wend(&u->sh->tmr.seq);
+
+	if((u->at=phase(u,u->at)))
+	{
+		settimer(u,u->at);
+
+		/* a pulse may have been handed over in between */
+
+		if(UNLIKELY((val=__atomic_load_n(&u->arm,__ATOMIC_SEQ_CST))))
+			settimer(u,val);
+	}
+}
+
+static HOT void hput(struct hist *h,long long val)
+{
+	int i;
+
+	if(val<0)val=0;
+	else if(val>=ADBINS*1000LL)val=ADBINS*1000LL-1;
+	h->bin[val/1000]++;
+
+	if(UNLIKELY(++h->total==ADDECAY))for(h->total=0,i=0;i<ADBINS;i++)
+	{
+		h->bin[i]>>=1;
+		h->total+=h->bin[i];
+	}
+}
+
+static HOT int hpct(struct hist *h,double pct)
+{
+	int i;
+	unsigned int sum;
+	unsigned int lim;
+
+	lim=(unsigned int)(h->total*pct/100.0+0.999);
+	for(sum=0,i=0;i<ADBINS-1;i++)if((sum+=h->bin[i])>=lim)break;
+	return (i+1)*1000;
+}
+
+static HOT int bound(int val,int max)
+{
+	val+=ADMARGIN;
+	if(val<ADMIN)val=ADMIN;
+	if(val>max)val=max;
+	return val;
+}
+
+static COLD long long lhpct(struct lhist *h,double pct)
+{
+	int i;
+	int e;
+	long long val;
+	unsigned long sum;
+	unsigned long lim;
+
+	lim=(unsigned long)(h->total*pct/100.0+0.999);
+	for(sum=0,i=0;i<LHBINS-1;i++)if((sum+=h->bin[i])>=lim)break;
+
+	if(i<(2<<LHSUB))val=i;
+	else
+	{
+		e=(i>>LHSUB)-1;
+		val=((long long)((i&((1<<LHSUB)-1))+(1<<LHSUB)+1)<<e)-1;
+	}
+	return val<h->max?val:h->max;
+}
+
+static HOT void adapt(struct unit *u,long long now,long long lat,
+	long long late)
+{
+	long long val;
+	long long pulse;
+	struct common *c=u->c;
+
+	/* time from the predicted edge until the pulse was seen */
+
+	val=lat+late;
+	hput(&u->post,val);
+	if(UNLIKELY(val>=u->pof))u->pof=c->pof;
+
+	/* pre pulse poll mode time that was actually required */
+
+	pulse=now-lat;
+	val=__atomic_load_n(&u->pstart,__ATOMIC_ACQUIRE);
+	if(val>pulse-1500000000LL&&val<pulse+500000000LL)
+	{
+		val=u->wprf-(pulse-val);
+		hput(&u->pre,val);
+		if(UNLIKELY(val>=u->wprf))u->prf=c->prf;
+	}
+
+	if(u->post.total>=64&&!(u->post.total&15))
+	{
+		u->pof=bound(hpct(&u->post,c->adapt),c->pof);
+		if(c->prf&&u->pre.total>=64)
+			u->prf=bound(hpct(&u->pre,c->adapt),c->prf);
+	}
+}
+
+static HOT long long pll(struct unit *u,long long edge,long long *err)
+{
+	long long k;
+	long long e;
+
+	/* pulse edge on the monotonic clock, error is predicted - observed */
+
+	*err=0;
+	if(LIKELY(u->hcnt))
+	{
+		k=(edge-u->phi+u->per/2)/u->per;
+		e=u->phi+k*u->per-edge;
+		if(LIKELY(k>=1&&k<=HOLDSPAN)&&LIKELY(e>-PLLMAX&&e<PLLMAX))
+		{
+			*err=e;
+			u->phi+=k*u->per-e/PLLKP;
+			__atomic_store_n(&u->per,u->per-e/(k*PLLKI),
+				__ATOMIC_RELAXED);
+			u->jit+=((e<0?-e:e)-u->jit)/8;
+
+			wbegin(&u->sh->pps.seq);
+			u->sh->pps.steer=(long)e;
+			account(&u->sh->pps.serr,(long)e);
+			wend(&u->sh->pps.seq);
+
+			if(++u->hcnt>=HOLDMIN)
+			{
+				__atomic_store_n(&u->hdev,u->jit,__ATOMIC_RELAXED);
+				__atomic_store_n(&u->hper,u->per,__ATOMIC_RELAXED);
+			}
+			return u->phi;
+		}
+
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.resets++;
+		wend(&u->sh->pps.seq);
+	}
+
+	/* (re)start on this edge, the period learned so far is kept */
+
+	__atomic_store_n(&u->hper,0,__ATOMIC_RELAXED);
+	u->phi=edge;
+	u->jit=0;
+	u->hcnt=1;
+	return edge;
+}
+
+static HOT void record(struct unit *u,struct pps_kinfo *info,long long now,
+	long long rt,int type)
+{
+	long long e;
+	unsigned long long n;
+	struct rrec *r;
+	struct common *c=u->c;
+
+	if(!c->rhdr)return;
+
+	n=__atomic_fetch_add(&c->rhdr->head,1,__ATOMIC_RELAXED);
+	r=&c->rrec[n%c->rhdr->entries];
+
+	/* a record is valid if its number matches after copying it */
+
+	__atomic_store_n(&r->nr,0,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->unit=(unsigned char)(u-c->unit);
+	r->type=(unsigned char)type;
+	r->mono=now;
+	r->raw=rawmono();
+	r->real=rt;
+	if(info)
+	{
+		r->aseq=info->assert_sequence;
+		r->cseq=info->clear_sequence;
+		r->assert=info->assert_tu.sec*1000000000LL+info->assert_tu.nsec;
+		r->clear=info->clear_tu.sec*1000000000LL+info->clear_tu.nsec;
+	}
+	else r->aseq=r->cseq=r->assert=r->clear=0;
+
+	/* idle phase in effect at the most recent edge */
+
+	e=r->assert>r->clear?r->assert:r->clear;
+	r->level=(unsigned char)pulselevel(u->idle[0],e?now-rt+e:now);
+
+	__atomic_store_n(&r->nr,(unsigned int)(n+1),__ATOMIC_RELEASE);
+}
+
+static COLD void capture(struct unit *u,int both)
+{
+#ifndef SIMULATE
+	struct pps_kparams prm;
+
+	if(ioctl(u->ppsfd,PPS_GETPARAMS,&prm))return;
+	prm.mode&=~PPS_CAPTUREBOTH;
+	prm.mode|=both?PPS_CAPTUREBOTH:
+		u->c->edge==1?PPS_CAPTUREASSERT:PPS_CAPTURECLEAR;
+	if(ioctl(u->ppsfd,PPS_SETPARAMS,&prm))return;
+#endif
+	u->sample=both;
+}
+
+static COLD void width(struct unit *u,struct pps_kinfo *info,long long now,
+	long long rt)
+{
+	long long w;
+
+	/* off time edge of a both edge sample, pulse width sanity check */
+
+	w=info->clear_tu.sec*1000000000LL+info->clear_tu.nsec-
+		info->assert_tu.sec*1000000000LL-info->assert_tu.nsec;
+	if(u->c->edge==2)w=-w;
+
+	wbegin(&u->sh->pps.seq);
+	u->sh->pps.width=(long)w;
+	if(w<=0||w>=WIDTHMAX)u->sh->pps.wbad++;
+	wend(&u->sh->pps.seq);
+
+	record(u,info,now,rt,'w');
+	capture(u,0);
+}
+
+static HOT void track(struct unit *u,long long now,long long rt,
+	long long pulse)
+{
+	long long at;
+	long long err;
+	struct common *c=u->c;
+
+	lhput(&u->lat[pulselevel(u->idle[0],now-rt+pulse)],rt-pulse);
+
+	at=pll(u,now-rt+pulse,&err);
+
+	if(c->adapt)adapt(u,now,rt-pulse,-err);
+	account(&u->wpre,u->prf);
+	account(&u->wpost,u->pof);
+
+	__atomic_store_n(&u->win,((long long)u->prf<<32)|u->pof,
+		__ATOMIC_SEQ_CST);
+	u->wprf=u->prf;
+	arm(u,at+u->pof);
+}
+
+static HOT void process(struct unit *u,struct pps_kinfo *info,long long now,
+	long long rt)
+{
+	long delta;
+	long nsec;
+	long long pulse;
+	struct pps_ktime *t;
+	struct common *c=u->c;
+
+	if(c->edge)
+	{
+		if(UNLIKELY((c->edge==1?info->assert_sequence:
+		    info->clear_sequence)==u->eseq))
+		{
+			if(u->sample)width(u,info,now,rt);
+			return;
+		}
+		u->eseq=c->edge==1?info->assert_sequence:info->clear_sequence;
+		if(UNLIKELY(u->sample))capture(u,0);
+	}
+
+	wbegin(&u->sh->pps.seq);
+	u->sh->pps.pulses++;
+	wend(&u->sh->pps.seq);
+
+	if(UNLIKELY(u->first))
+	{
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.relocks++;
+		u->sh->pps.locked=1;
+		wend(&u->sh->pps.seq);
+		u->first=0;
+		record(u,info,now,rt,'f');
+		return;
+	}
+
+	if(c->edge)
+	{
+		t=c->edge==1?&info->assert_tu:&info->clear_tu;
+		delta=1000000000;
+		nsec=t->nsec;
+		pulse=t->sec*1000000000LL+nsec;
+	}
+	else if(UNLIKELY(!info->clear_sequence)&&
+	    UNLIKELY(!info->clear_tu.sec)&&!info->clear_tu.nsec)
+	{
+		delta=600000000;
+		nsec=info->assert_tu.nsec;
+		pulse=info->assert_tu.sec*1000000000LL+nsec;
+	}
+	else if(info->assert_tu.sec>info->clear_tu.sec)
+	{
+		nsec=info->assert_tu.nsec;
+		pulse=info->assert_tu.sec*1000000000LL+nsec;
+		delta=info->assert_tu.sec-info->clear_tu.sec>1?1000000000:
+			1000000000+info->assert_tu.nsec-info->clear_tu.nsec;
+	}
+	else if(info->assert_tu.sec<info->clear_tu.sec)
+	{
+		nsec=info->clear_tu.nsec;
+		pulse=info->clear_tu.sec*1000000000LL+nsec;
+		delta=info->clear_tu.sec-info->assert_tu.sec>1?1000000000:
+			1000000000+info->clear_tu.nsec-info->assert_tu.nsec;
+	}
+	else if(info->assert_tu.nsec>info->clear_tu.nsec)
+	{
+		delta=info->assert_tu.nsec-info->clear_tu.nsec;
+		nsec=info->assert_tu.nsec;
+		pulse=info->assert_tu.sec*1000000000LL+nsec;
+	}
+	else if(info->assert_tu.nsec<info->clear_tu.nsec)
+	{
+		delta=info->clear_tu.nsec-info->assert_tu.nsec;
+		nsec=info->clear_tu.nsec;
+		pulse=info->clear_tu.sec*1000000000LL+nsec;
+	}
+	else
+	{
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.locked=0;
+		wend(&u->sh->pps.seq);
+		if(!u->first)u->first=1;
+		record(u,info,now,rt,'i');
+		return;
+	}
+
+	if(delta<600000000)
+	{
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.rejected++;
+		wend(&u->sh->pps.seq);
+		record(u,info,now,rt,'r');
+		return;
+	}
+
+	record(u,info,now,rt,'p');
+
+	track(u,now,rt,pulse);
+
+	if(c->edge&&UNLIKELY(!(++u->wcnt%WIDTHINT)))capture(u,1);
+}
+
+#ifndef SIMULATE
+
+static HOT void event(struct unit *u,long long pulse,long long now,
+	long long rt)
+{
+	struct pps_kinfo info;
+
+	memset(&info,0,sizeof(info));
+	info.assert_sequence=++u->aseq;
+	info.assert_tu.sec=pulse/1000000000;
+	info.assert_tu.nsec=(int)(pulse%1000000000);
+
+	/* one event per second, e.g. a 1Hz ptp sync, is used */
+
+	if(UNLIKELY(pulse-u->evlast<600000000LL)&&LIKELY(!u->first))
+	{
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.rejected++;
+		wend(&u->sh->pps.seq);
+		record(u,&info,now,rt,'r');
+		return;
+	}
+	u->evlast=pulse;
+
+	wbegin(&u->sh->pps.seq);
+	u->sh->pps.pulses++;
+	wend(&u->sh->pps.seq);
+
+	if(UNLIKELY(u->first))
+	{
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.relocks++;
+		u->sh->pps.locked=1;
+		wend(&u->sh->pps.seq);
+		u->first=0;
+		record(u,&info,now,rt,'f');
+		return;
+	}
+
+	record(u,&info,now,rt,'p');
+
+	/* the pll locks onto the phase of the events */
+
+	track(u,now,rt,pulse);
+}
+
+static HOT void receive(struct unit *u)
+{
+	int l;
+	long long now;
+	long long rt;
+	long long pulse;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct timespec *ts;
+	char data[64];
+	char ctl[CMSG_SPACE(sizeof(struct timespec))+64];
+
+	while(1)
+	{
+		iov.iov_base=data;
+		iov.iov_len=sizeof(data);
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov=&iov;
+		msg.msg_iovlen=1;
+		msg.msg_control=ctl;
+		msg.msg_controllen=sizeof(ctl);
+		if((l=recvmsg(u->ppsfd,&msg,MSG_DONTWAIT))<0)break;
+		now=mono();
+		rt=real();
+
+		/* ptp delay requests share port 319, only sync (type 0) counts */
+
+		if(u->port==319&&(l<1||(data[0]&0x0f)))continue;
+
+		/* the kernel receive timestamp takes the role of the pulse */
+
+		for(pulse=rt,cm=CMSG_FIRSTHDR(&msg);cm;cm=CMSG_NXTHDR(&msg,cm))
+			if(cm->cmsg_level==SOL_SOCKET&&
+			    cm->cmsg_type==SCM_TIMESTAMPNS)
+		{
+			ts=(struct timespec *)CMSG_DATA(cm);
+			pulse=ts->tv_sec*1000000000LL+ts->tv_nsec;
+		}
+
+		event(u,pulse,now,rt);
+	}
+}
+
+#endif
+
+static HOT void dropout(struct unit *u)
+{
+	/* the phase switches follow the predicted pulses during holdover */
+
+	if(u->c->hold&&__atomic_load_n(&u->hper,__ATOMIC_RELAXED)&&
+	    __atomic_load_n(&u->hold,__ATOMIC_ACQUIRE)!=-1)
+	{
+		wbegin(&u->sh->pps.seq);
+		u->sh->pps.timeouts++;
+		wend(&u->sh->pps.seq);
+		record(u,NULL,mono(),real(),'t');
+		return;
+	}
+
+	/* a window waiting for a missing pulse stays open until now */
+
+	if(u->level==LVL_POLL)account(&u->wmiss,
+		mono()-__atomic_load_n(&u->pstart,__ATOMIC_ACQUIRE));
+
+	wbegin(&u->sh->pps.seq);
+	u->sh->pps.timeouts++;
+	u->sh->pps.locked=0;
+	wend(&u->sh->pps.seq);
+	if(!u->first)u->first=1;
+	record(u,NULL,mono(),real(),'t');
+}
+
+static HOT void ready(struct unit *u)
+{
+	if(UNLIKELY(u->first==1))
+	{
+		arm(u,ARM_RESET);
+		u->first=2;
+	}
+}
+
+#ifndef SIMULATE
+
+static HOT void *helper(void *arg)
+{
+	sigset_t set;
+	struct fmsg msg;
+	struct unit *u=arg;
+	struct pps_fdata data;
+
+	sigemptyset(&set);
+	sigaddset(&set,SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK,&set,NULL);
+
+	memset(&msg,0,sizeof(msg));
+	memset(&data,0,sizeof(data));
+	data.timeout.sec=1;
+	data.timeout.nsec=100000000;
+
+	/* blocking fetch for pps devices that can't be polled */
+
+	while(LIKELY(!__atomic_load_n(&doterm,__ATOMIC_ACQUIRE))&&
+	    LIKELY(!__atomic_load_n(&u->gone,__ATOMIC_ACQUIRE)))
+	{
+		if(UNLIKELY(ioctl(u->ppsfd,PPS_FETCH,&data)==-1))switch(errno)
+		{
+		case ETIMEDOUT:
+			msg.timeout=1;
+			break;
+
+		/* the device is gone, wait for the uevent to detach */
+
+		case ENODEV:
+		case ENXIO:
+			usleep(100000);
+		default:continue;
+		}
+		else
+		{
+			msg.now=mono();
+			msg.rt=real();
+			msg.timeout=0;
+			msg.info=data.info;
+		}
+
+		if(UNLIKELY(write(u->pfd[1],&msg,sizeof(msg))!=sizeof(msg)))
+			continue;
+	}
+
+	return NULL;
+}
+
+static HOT void watch(struct unit *u)
+{
+	struct itimerspec it;
+
+	memset(&it,0,sizeof(it));
+	it.it_value.tv_sec=1;
+	it.it_value.tv_nsec=100000000;
+	timerfd_settime(u->wfd,0,&it,NULL);
+}
+
+static COLD int pollable(int fd)
+{
+	struct pollfd p;
+	struct pps_fdata data;
+
+	/* old kernels always report readable, new ones until a fetch */
+
+	memset(&data,0,sizeof(data));
+	if(ioctl(fd,PPS_FETCH,&data))return 0;
+
+	p.fd=fd;
+	p.events=POLLIN;
+	return poll(&p,1,0)?0:1;
+}
+
+static COLD int addev(int ep,int fd,int type,int idx)
+{
+	struct epoll_event e;
+
+	memset(&e,0,sizeof(e));
+	e.events=EPOLLIN;
+	e.data.u32=(idx<<8)|type;
+	return epoll_ctl(ep,EPOLL_CTL_ADD,fd,&e);
+}
+
+static COLD int mkthread(struct unit *u,pthread_t *tid,void *(*func)(void *))
+{
+	int r;
+	cpu_set_t cset;
+	sigset_t set;
+	sigset_t old;
+	pthread_attr_t attr;
+	struct sched_param param;
+
+	memset(&param,0,sizeof(param));
+	param.sched_priority=u->c->prio;
+	CPU_ZERO(&cset);
+	CPU_SET(u->cpu,&cset);
+
+	if(pthread_attr_init(&attr))return -1;
+	if(pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED)||
+	    pthread_attr_setschedpolicy(&attr,SCHED_RR)||
+	    pthread_attr_setschedparam(&attr,&param)||
+	    pthread_attr_setaffinity_np(&attr,sizeof(cset),&cset)||
+	    pthread_attr_setstacksize(&attr,65536))
+	{
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
+
+	/* signals are handled by the main thread */
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK,&set,&old);
+	r=pthread_create(tid,&attr,func,u);
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+
+	pthread_attr_destroy(&attr);
+	return r?-1:0;
+}
+
+static COLD int attach(struct unit *u)
+{
+	int i;
+	struct unit *g;
+	struct common *c=u->c;
+
+	if(u->ppsfd==-1&&(u->ppsfd=opensrc(u))==-1)return -1;
+
+	i=u-c->unit;
+	for(g=c->unit;g->cpu!=u->cpu;g++);
+
+	if(u->net)
+	{
+		if(u->wfd==-1&&
+		    ((u->wfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC))==-1||
+		    addev(g->epfd,u->wfd,EV_WATCH,i)))goto fail;
+		if(addev(g->epfd,u->ppsfd,EV_NET,i))goto fail;
+		watch(u);
+		return 0;
+	}
+
+	if(pollable(u->ppsfd))
+	{
+		if(u->wfd==-1&&
+		    ((u->wfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC))==-1||
+		    addev(g->epfd,u->wfd,EV_WATCH,i)))goto fail;
+		if(addev(g->epfd,u->ppsfd,EV_PPS,i))goto fail;
+		watch(u);
+	}
+	else
+	{
+		if(u->pfd[0]==-1&&(pipe2(u->pfd,O_CLOEXEC|O_DIRECT)||
+		    addev(g->epfd,u->pfd[0],EV_PIPE,i)))goto fail;
+		u->gone=0;
+		if(mkthread(u,&u->fid,helper))goto fail;
+	}
+	return 0;
+
+fail:	close(u->ppsfd);
+	u->ppsfd=-1;
+	return -1;
+}
+
+static COLD void detach(struct unit *u)
+{
+	struct unit *g;
+	struct itimerspec it;
+	struct common *c=u->c;
+
+	for(g=c->unit;g->cpu!=u->cpu;g++);
+
+	if(u->pfd[0]!=-1)
+	{
+		__atomic_store_n(&u->gone,1,__ATOMIC_RELEASE);
+		pthread_kill(u->fid,SIGUSR1);
+		pthread_join(u->fid,NULL);
+	}
+	else
+	{
+		epoll_ctl(g->epfd,EPOLL_CTL_DEL,u->ppsfd,NULL);
+		memset(&it,0,sizeof(it));
+		timerfd_settime(u->wfd,0,&it,NULL);
+	}
+	close(u->ppsfd);
+	u->ppsfd=-1;
+
+	/* like a missing pulse, holdover continues on its own */
+
+	dropout(u);
+	ready(u);
+}
+
+static COLD int openuevent(struct common *c)
+{
+	struct sockaddr_nl addr;
+
+	if((c->nlfd=socket(AF_NETLINK,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT))==-1)return -1;
+
+	memset(&addr,0,sizeof(addr));
+	addr.nl_family=AF_NETLINK;
+	addr.nl_groups=1;
+	if(bind(c->nlfd,(struct sockaddr *)&addr,sizeof(addr)))
+	{
+		close(c->nlfd);
+		c->nlfd=-1;
+		return -1;
+	}
+	return 0;
+}
+
+static COLD void quiesce(struct common *c)
+{
+	uint64_t val=1;
+
+	/* the other event loops park at their next wakeup */
+
+	if(!c->loops)return;
+	pthread_mutex_lock(&c->qmtx);
+	__atomic_store_n(&c->quiet,1,__ATOMIC_SEQ_CST);
+	if(write(c->qfd,&val,sizeof(val))!=sizeof(val))perror("write");
+	while(c->parked<c->loops)pthread_cond_wait(&c->qcond,&c->qmtx);
+	pthread_mutex_unlock(&c->qmtx);
+}
+
+static COLD void resume(struct common *c)
+{
+	uint64_t val;
+
+	if(!c->loops)return;
+	pthread_mutex_lock(&c->qmtx);
+	if(read(c->qfd,&val,sizeof(val))!=sizeof(val))perror("read");
+	__atomic_store_n(&c->quiet,0,__ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&c->qcond);
+	pthread_mutex_unlock(&c->qmtx);
+}
+
+static COLD void park(struct common *c)
+{
+	pthread_mutex_lock(&c->qmtx);
+	c->parked++;
+	pthread_cond_broadcast(&c->qcond);
+	while(__atomic_load_n(&c->quiet,__ATOMIC_ACQUIRE))
+		pthread_cond_wait(&c->qcond,&c->qmtx);
+	c->parked--;
+	pthread_mutex_unlock(&c->qmtx);
+}
+
+static COLD void uevent(struct common *c)
+{
+	int i;
+	int l;
+	int pps;
+	int act;
+	char *p;
+	char *name;
+	struct unit *u;
+	socklen_t alen;
+	struct sockaddr_nl addr;
+	char bfr[4096];
+
+	while(1)
+	{
+		alen=sizeof(addr);
+		if((l=recvfrom(c->nlfd,bfr,sizeof(bfr)-1,MSG_DONTWAIT,
+			(struct sockaddr *)&addr,&alen))<1)break;
+
+		/* only kernel messages, "<action>@<path>" and "<key>=<value>" */
+
+		if(addr.nl_pid)continue;
+		bfr[l]=0;
+		for(pps=0,act=0,name=NULL,p=bfr;p<bfr+l;p+=strlen(p)+1)
+		{
+			if(!strcmp(p,"SUBSYSTEM=pps"))pps=1;
+			else if(!strcmp(p,"ACTION=add"))act=1;
+			else if(!strcmp(p,"ACTION=remove"))act=2;
+			else if(!strncmp(p,"DEVNAME=",8))name=p+8;
+		}
+		if(!pps||!act||!name)continue;
+
+		/* all other event loops are parked while the units change */
+
+		quiesce(c);
+		for(i=0;i<c->units;i++)
+		{
+			u=&c->unit[i];
+			if(act==2&&u->ppsfd!=-1&&!strcmp(u->pps,name))
+			{
+				detach(u);
+				if(c->fg)fprintf(stderr,
+					"pps device for %s detached\n",u->dev);
+			}
+			else if(act==1&&u->ppsfd==-1&&!attach(u))
+			{
+				wbegin(&u->sh->pps.seq);
+				u->sh->pps.attached++;
+				wend(&u->sh->pps.seq);
+				if(c->fg)fprintf(stderr,
+					"pps device for %s attached\n",u->dev);
+			}
+		}
+		resume(c);
+	}
+}
+
+#else
+
+static COLD void simnext(struct unit *u)
+{
+	int n;
+	char type;
+	long long a;
+	long long b;
+	char bfr[256];
+
+	while(fgets(bfr,sizeof(bfr),u->trace))
+	{
+		if((n=sscanf(bfr," %c %lld %lld",&type,&a,&b))<2)continue;
+		if(type!='a'&&type!='c'&&(type!='s'||n!=3))continue;
+		u->type=type;
+		u->when=a;
+		u->delay=n==3?b:SIMLAT;
+		return;
+	}
+	u->type=0;
+}
+
+static COLD void simulate(struct common *c)
+{
+	int i;
+	int ev=0;
+	int live;
+	long long t;
+	long long r;
+	long long end=0;
+	struct unit *u;
+	struct unit *sel=NULL;
+	struct pps_kinfo info;
+
+	for(i=0;i<c->units;i++)
+	{
+		c->unit[i].due=-1;
+		c->unit[i].fstart=0;
+		c->unit[i].edge=0;
+		c->unit[i].tail=0;
+		memset(&c->unit[i].info,0,sizeof(c->unit[i].info));
+		simnext(&c->unit[i]);
+		ready(&c->unit[i]);
+	}
+
+	while(1)
+	{
+		/* timers take precedence over pps events at the same time */
+
+		for(t=LLONG_MAX,live=0,i=0;i<c->units;i++)
+			if(c->unit[i].due!=-1&&c->unit[i].due<t)
+		{
+			t=c->unit[i].due;
+			sel=&c->unit[i];
+			ev=0;
+		}
+
+		for(i=0;i<c->units;i++)
+		{
+			u=&c->unit[i];
+			if(u->type)
+			{
+				live++;
+				if(u->when>end)end=u->when;
+			}
+			if(u->type=='s')
+			{
+				if(u->when<t)
+				{
+					t=u->when;
+					sel=u;
+					ev=3;
+				}
+				continue;
+			}
+			if((r=u->when+u->delay)<u->fstart)r=u->fstart;
+			if(u->type&&r<u->fstart+SIMTMO)
+			{
+				if(r<t)
+				{
+					t=r;
+					sel=u;
+					ev=1;
+				}
+			}
+			else if(u->fstart+SIMTMO<t)
+			{
+				t=u->fstart+SIMTMO;
+				sel=u;
+				ev=2;
+			}
+		}
+
+		if(!live&&t>end+SIMTAIL)break;
+
+		vclock=t;
+		u=sel;
+
+		switch(ev)
+		{
+		case 0:	u->due=-1;
+			expire(u,vclock);
+			continue;
+
+		case 1:	if(c->edge&&!u->sample&&
+			    u->type!=(c->edge==1?'a':'c'))
+			{
+				simnext(u);
+				continue;
+			}
+			r=u->when+voff;
+
+			/* a time out runs from the last edge of a pulse */
+
+			if(u->type=='a')u->edge=u->when;
+			else if(u->edge&&u->when-u->edge>u->tail)
+				u->tail=u->when-u->edge;
+			if(u->type=='a')
+			{
+				u->info.assert_sequence++;
+				u->info.assert_tu.sec=r/1000000000;
+				u->info.assert_tu.nsec=r%1000000000;
+			}
+			else
+			{
+				u->info.clear_sequence++;
+				u->info.clear_tu.sec=r/1000000000;
+				u->info.clear_tu.nsec=r%1000000000;
+			}
+			info=u->info;
+			process(u,&info,vclock,real());
+			simnext(u);
+			break;
+
+		case 2:	dropout(u);
+			break;
+
+		case 3:	voff+=u->delay;
+			simnext(u);
+			continue;
+		}
+
+		u->fstart=vclock;
+		ready(u);
+	}
+}
+
+static COLD int generate(struct common *c)
+{
+	int i;
+	int j;
+	long long t;
+	unsigned long long r=88172645463325252ULL;
+
+	for(i=1;i<=c->gen;i++)
+	{
+		if(c->stepat==i)printf("s %lld %lld\n",i*1000000000LL-500000000,
+			c->step);
+		r^=r<<13;
+		r^=r>>7;
+		r^=r<<17;
+		if(c->miss&&!(i%c->miss))continue;
+		t=i*1000000000LL;
+		if(c->jitter)t+=(long long)(r%(2*c->jitter+1))-c->jitter;
+		for(j=0;c->edges[j];j++)
+			printf("%c %lld\n",c->edges[j],t+j*(long long)c->width);
+	}
+	return 0;
+}
+
+#endif
+
+static COLD void lhtab(FILE *fp,const char *title,struct lhist *h)
+{
+	int i;
+	int k;
+	static const char *name[3]={"all states","low latency","poll"};
+	static const double pct[5]={50,90,99,99.9,99.99};
+
+	fprintf(fp,"%-11s %10s %9s %9s %9s %9s %9s %9s\n",title,
+		"count","50%","90%","99%","99.9%","99.99%","max");
+	for(i=0;i<3;i++)if(h[i].total)
+	{
+		fprintf(fp,"%-11s %10lu",name[i],h[i].total);
+		for(k=0;k<5;k++)fprintf(fp," %9lld",lhpct(&h[i],pct[k]));
+		fprintf(fp," %9lld\n",h[i].max);
+	}
+}
+
+static COLD void dumplat(struct common *c,FILE *fp)
+{
+	int j;
+
+	for(j=0;j<c->units;j++)
+	{
+		fprintf(fp,"%s pps latency (ns):\n",c->unit[j].dev);
+		lhtab(fp,"phase",c->unit[j].lat);
+	}
+}
+
+static COLD int counter(int fd,unsigned long long *val)
+{
+	int l;
+	char *end;
+	char bfr[32];
+
+	if((l=pread(fd,bfr,sizeof(bfr)-1,0))<1)return -1;
+	bfr[l]=0;
+	*val=strtoull(bfr,&end,10);
+	if(end==bfr||(*end&&*end!='\n'))return -1;
+	return 0;
+}
+
+static COLD int readname(char *path,char *name,int len)
+{
+	int l;
+	int fd;
+
+	if((fd=open(path,O_RDONLY|O_CLOEXEC))==-1)return -1;
+	l=read(fd,name,len-1);
+	close(fd);
+	if(l<1)return -1;
+	name[l]=0;
+	if(name[l-1]=='\n')name[l-1]=0;
+	return 0;
+}
+
+static COLD void sample(struct common *c)
+{
+	int i;
+	int j;
+	long long now;
+	unsigned long long v;
+	struct rcore *r;
+	struct rzone *z;
+	struct sched *s=NULL;
+
+	now=mono();
+	if(c->nsched)
+	{
+		s=&c->sched[(c->nsched-1)%SCHEDS];
+		s->dur+=now-c->mlast;
+	}
+	c->mlast=now;
+
+	/* the energy counters wrap at max_energy_range_uj */
+
+	for(i=0;i<c->nzones;i++)
+	{
+		z=&c->zone[i];
+		if(counter(z->fd,&v))continue;
+		if(s)s->energy+=v>=z->last?v-z->last:v+z->max-z->last;
+		z->last=v;
+	}
+
+	for(i=0;i<c->ncores;i++)for(r=&c->core[i],j=0;j<r->n;j++)
+	{
+		if(!counter(r->ufd[j],&v))
+		{
+			if(s)s->usage[r->grp][j]+=v-r->usage[j];
+			r->usage[j]=v;
+		}
+		if(!counter(r->tfd[j],&v))
+		{
+			if(s)s->time[r->grp][j]+=v-r->time[j];
+			r->time[j]=v;
+		}
+	}
+}
+
+static COLD void newsched(struct common *c)
+{
+	struct sched *s;
+	static const char *name[3]={"dma","state","qos"};
+
+	sample(c);
+	s=&c->sched[c->nsched++%SCHEDS];
+	memset(s,0,sizeof(struct sched));
+	s->ncpu=c->ncores;
+	sprintf(s->label,"t=%d p=%d P=%d l=%d L=%d a=%d b=%s",c->thres,
+		c->prf/1000000,c->pof/1000000,c->prh/1000000,c->poh/1000000,
+		c->all,name[c->all?0:c->idle[0].qos+1]);
+}
+
+static COLD int openmeter(struct common *c)
+{
+	int i;
+	int j;
+	int k;
+	int fd;
+	DIR *d;
+	struct dirent *e;
+	struct rcore *r;
+	char name[16];
+	char bfr[512];
+
+	c->ncores=0;
+	c->nzones=0;
+	c->nsched=0;
+
+	for(i=0;i<c->units;i++)for(j=0;j<c->unit[i].ncpu;j++)
+	{
+		for(k=0;k<c->ncores;k++)
+			if(c->core[k].cpu==c->unit[i].cpus[j])break;
+		if(k<c->ncores||c->ncores==MAXCORES)continue;
+
+		r=&c->core[c->ncores];
+		r->cpu=c->unit[i].cpus[j];
+		for(r->n=0;r->n<32;r->n++)
+		{
+			k=sprintf(bfr,
+			    "%s/sys/devices/system/cpu/cpu%d/cpuidle/state%d/",
+			    root,r->cpu,r->n);
+			strcpy(bfr+k,"usage");
+			if((r->ufd[r->n]=open(bfr,O_RDONLY|O_CLOEXEC))==-1)
+				break;
+			strcpy(bfr+k,"time");
+			if((r->tfd[r->n]=open(bfr,O_RDONLY|O_CLOEXEC))==-1)
+			{
+				close(r->ufd[r->n]);
+				break;
+			}
+			strcpy(bfr+k,"name");
+			if(readname(bfr,r->sname[r->n],sizeof(r->sname[0])))
+				sprintf(r->sname[r->n],"state%d",r->n);
+		}
+		if(r->n)c->ncores++;
+	}
+
+	/* hybrid cores may differ, residency is summed per state table */
+
+	for(c->ngrps=0,i=0;i<c->ncores;i++)
+	{
+		r=&c->core[i];
+		for(k=0;k<i;k++)if(c->core[k].grp==k&&c->core[k].n==r->n&&
+		    !memcmp(c->core[k].sname,r->sname,sizeof(r->sname)))break;
+		r->grp=k;
+		r->ngrp=0;
+		c->core[k].ngrp++;
+		if(k==i)c->ngrps++;
+	}
+
+	/* package zones only, core and uncore zones are part of them */
+
+	sprintf(bfr,"%s/sys/class/powercap",root);
+	if((d=opendir(bfr)))
+	{
+		while(c->nzones<MAXZONES&&(e=readdir(d)))
+		{
+			if(strncmp(e->d_name,"intel-rapl:",11)||
+			    strchr(e->d_name+11,':'))continue;
+			k=sprintf(bfr,"%s/sys/class/powercap/%s/",root,
+				e->d_name);
+			strcpy(bfr+k,"name");
+			if(readname(bfr,name,sizeof(name))||
+			    strncmp(name,"package",7))continue;
+			strcpy(bfr+k,"max_energy_range_uj");
+			if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)continue;
+			j=counter(fd,&c->zone[c->nzones].max);
+			close(fd);
+			if(j)continue;
+			strcpy(bfr+k,"energy_uj");
+			if((c->zone[c->nzones].fd=open(bfr,O_RDONLY|O_CLOEXEC))
+				!=-1)c->nzones++;
+		}
+		closedir(d);
+	}
+
+	if(!c->ncores&&!c->nzones)return -1;
+
+	newsched(c);
+	return 0;
+}
+
+static COLD void closemeter(struct common *c)
+{
+	int i;
+	int j;
+
+	for(i=0;i<c->nzones;i++)close(c->zone[i].fd);
+	for(i=0;i<c->ncores;i++)for(j=0;j<c->core[i].n;j++)
+	{
+		close(c->core[i].ufd[j]);
+		close(c->core[i].tfd[j]);
+	}
+}
+
+static COLD void dumpres(struct common *c,FILE *fp)
+{
+	int i;
+	int j;
+	int k;
+	struct rcore *r;
+	struct sched *s;
+
+	sample(c);
+
+	for(i=c->nsched>SCHEDS?c->nsched-SCHEDS:0;i<c->nsched;i++)
+	{
+		s=&c->sched[i%SCHEDS];
+		if(s->dur<=0)continue;
+		fprintf(fp,"schedule %s for %.1fs:\n",s->label,s->dur/1e9);
+		if(c->nzones)fprintf(fp,"package power %.3fW\n",
+			s->energy*1000.0/s->dur);
+		if(s->ncpu)for(k=0;k<c->ncores;k++)
+		{
+			r=&c->core[k];
+			if(r->grp!=k)continue;
+			if(c->ngrps>1)fprintf(fp,"%d cores with the states of "
+				"core %d:\n",r->ngrp,r->cpu);
+			for(j=0;j<r->n;j++)fprintf(fp,"%-11s residency %8.4f%%  "
+				"entries %10.1f/s per core\n",r->sname[j],
+				s->time[k][j]*100000.0/s->dur/r->ngrp,
+				s->usage[k][j]*1e9/s->dur/r->ngrp);
+		}
+	}
+}
+
+static COLD int report(struct common *c)
+{
+	int i;
+	int j;
+	int r=0;
+#ifdef SIMULATE
+	int k;
+	long e;
+	long long sch;
+	struct unit *u;
+#endif
+	long long tot;
+	long long dw[3];
+	static const char *name[3]={"all states","low latency","poll"};
+
+	for(j=0;j<c->idles;j++)
+	{
+		if(c->idle[j].cpu==-1)fprintf(stderr,
+			"dma latency backend transition times:\n");
+		else fprintf(stderr,"core %d %s backend transition times:\n",
+			c->idle[j].cpu,c->idle[j].qos?"pm qos":"idle state");
+		for(i=0;i<3;i++)if(c->idle[j].ts[i].cnt)fprintf(stderr,
+			"to %-11s %10lu  min %7ldns  avg %7lldns  max %7ldns\n",
+			name[i],c->idle[j].ts[i].cnt,c->idle[j].ts[i].min,
+			c->idle[j].ts[i].sum/(long long)c->idle[j].ts[i].cnt,
+			c->idle[j].ts[i].max);
+		memcpy(dw,c->idle[j].dwell,sizeof(dw));
+		dw[c->idle[j].level]+=mono()-c->idle[j].since;
+		if((tot=dw[LVL_ALL]+dw[LVL_LOW]+dw[LVL_POLL])>0)fprintf(stderr,
+			"time in all states %.4f%%  low latency %.4f%%  "
+			"poll %.4f%%\n",dw[LVL_ALL]*100.0/tot,
+			dw[LVL_LOW]*100.0/tot,dw[LVL_POLL]*100.0/tot);
+#ifdef SIMULATE
+		/* configured windows, a time out and the pll error per pulse */
+
+		for(sch=0,i=0;i<c->units;i++)
+			for(u=&c->unit[i],k=0;k<u->nidle;k++)
+		{
+			if(u->idle[k]!=&c->idle[j])continue;
+			e=u->sh->pps.serr.max>-u->sh->pps.serr.min?
+				u->sh->pps.serr.max:-u->sh->pps.serr.min;
+			sch+=(c->prf+c->pof+e)*(long long)u->wpre.cnt+
+				(c->prf+SIMTMO+SIMLAT+u->tail-1000000000LL)*
+				(long long)u->sh->pps.timeouts;
+		}
+		if(tot>0)fprintf(stderr,"poll check %.4f%% versus %.4f%% "
+			"configured %s\n",dw[LVL_POLL]*100.0/tot,sch*100.0/tot,
+			dw[LVL_POLL]>sch?"FAILED":"ok");
+		if(dw[LVL_POLL]>sch)r=-1;
+#endif
+	}
+
+	for(j=0;j<c->units;j++)if(c->unit[j].sh->tmr.late.cnt)
+	{
+		fprintf(stderr,"%s timer lateness:\n",c->unit[j].dev);
+		fprintf(stderr,
+			"phase switch   %10lu  min %7ldns  avg %7lldns  max %7ldns\n",
+			c->unit[j].sh->tmr.late.cnt,c->unit[j].sh->tmr.late.min,
+			c->unit[j].sh->tmr.late.sum/
+			(long long)c->unit[j].sh->tmr.late.cnt,
+			c->unit[j].sh->tmr.late.max);
+		if(c->unit[j].sh->pps.serr.cnt)fprintf(stderr,
+			"steering error %10lu  min %7ldns  avg %7lldns  max %7ldns\n",
+			c->unit[j].sh->pps.serr.cnt,c->unit[j].sh->pps.serr.min,
+			c->unit[j].sh->pps.serr.sum/
+			(long long)c->unit[j].sh->pps.serr.cnt,
+			c->unit[j].sh->pps.serr.max);
+		if(c->unit[j].sh->pps.width)fprintf(stderr,
+			"pulse width %ldns  implausible samples %lu\n",
+			c->unit[j].sh->pps.width,c->unit[j].sh->pps.wbad);
+		if(c->unit[j].sh->tmr.holdover||c->unit[j].sh->tmr.degraded)
+			fprintf(stderr,"holdover pulses %lu  holdover ends %lu\n",
+				c->unit[j].sh->tmr.holdover,
+				c->unit[j].sh->tmr.degraded);
+		if(!c->unit[j].wpre.cnt)continue;
+		fprintf(stderr,"%s poll mode windows:\n",c->unit[j].dev);
+		fprintf(stderr,
+			"pre pulse      %10lu  min %7ldns  avg %7lldns  max %7ldns\n",
+			c->unit[j].wpre.cnt,c->unit[j].wpre.min,
+			c->unit[j].wpre.sum/(long long)c->unit[j].wpre.cnt,
+			c->unit[j].wpre.max);
+		fprintf(stderr,
+			"post pulse     %10lu  min %7ldns  avg %7lldns  max %7ldns\n",
+			c->unit[j].wpost.cnt,c->unit[j].wpost.min,
+			c->unit[j].wpost.sum/(long long)c->unit[j].wpost.cnt,
+			c->unit[j].wpost.max);
+		if(c->unit[j].wmiss.cnt)fprintf(stderr,
+			"missed pulse   %10lu  min %7ldns  avg %7lldns  max %7ldns\n",
+			c->unit[j].wmiss.cnt,c->unit[j].wmiss.min,
+			c->unit[j].wmiss.sum/(long long)c->unit[j].wmiss.cnt,
+			c->unit[j].wmiss.max);
+		fprintf(stderr,"poll mode duty cycle %.4f%%\n",
+			(double)(c->unit[j].wpre.sum+c->unit[j].wpost.sum)/
+			c->unit[j].wpre.cnt/10000000.0);
+	}
+
+	dumplat(c,stderr);
+	if(c->meter)dumpres(c,stderr);
+	return r;
+}
+
+static COLD int openstat(struct common *c)
+{
+	int i;
+	int fd=-1;
+
+	if(c->shm&&
+	    (fd=shm_open(c->shm,O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,0644))!=-1)
+	{
+		if(ftruncate(fd,sizeof(struct shmstat))||
+		    (c->stat=mmap(NULL,sizeof(struct shmstat),
+			PROT_READ|PROT_WRITE,MAP_SHARED,fd,0))==MAP_FAILED)
+		{
+			close(fd);
+			shm_unlink(c->shm);
+			fd=-1;
+		}
+		else close(fd);
+	}
+
+	if(fd==-1)
+	{
+		if(c->shm)
+			fprintf(stderr,"Warning: no shared memory statistics\n");
+		c->shm=NULL;
+		if((c->stat=mmap(NULL,sizeof(struct shmstat),
+			PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0))==
+			MAP_FAILED)return -1;
+	}
+
+	memset(c->stat,0,sizeof(struct shmstat));
+	c->stat->version=SHMVERS;
+	c->stat->units=c->units;
+	for(i=0;i<c->units;i++)
+	{
+		c->unit[i].sh=&c->stat->unit[i];
+		c->unit[i].sh->cpu=c->unit[i].cpu;
+		strncpy(c->unit[i].sh->dev,c->unit[i].dev,
+			sizeof(c->unit[i].sh->dev)-1);
+	}
+
+	return 0;
+}
+
+static COLD void closestat(struct common *c)
+{
+	if(c->shm)shm_unlink(c->shm);
+	munmap(c->stat,sizeof(struct shmstat));
+}
+
+static COLD int openring(struct common *c)
+{
+	int fd;
+	size_t len;
+	struct stat stb;
+
+	len=sizeof(struct rhdr)+(size_t)c->rents*sizeof(struct rrec);
+
+	if((fd=open(c->ring,O_RDWR|O_CREAT|O_CLOEXEC,0644))==-1)return -1;
+	if(fstat(fd,&stb)||(stb.st_size!=len&&ftruncate(fd,len))||
+	    (c->rhdr=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0))==
+		MAP_FAILED)
+	{
+		close(fd);
+		c->rhdr=NULL;
+		return -1;
+	}
+	close(fd);
+	c->rrec=(struct rrec *)(c->rhdr+1);
+
+	/* an existing recording of the same layout is continued */
+
+	if(c->rhdr->magic!=RINGMAGIC||c->rhdr->version!=RINGVERS||
+	    c->rhdr->size!=sizeof(struct rrec)||c->rhdr->entries!=c->rents)
+	{
+		memset(c->rhdr,0,sizeof(struct rhdr));
+		c->rhdr->version=RINGVERS;
+		c->rhdr->size=sizeof(struct rrec);
+		c->rhdr->entries=c->rents;
+		c->rhdr->magic=RINGMAGIC;
+	}
+
+	return 0;
+}
+
+static COLD void closering(struct common *c)
+{
+	if(c->rhdr)munmap(c->rhdr,
+		sizeof(struct rhdr)+(size_t)c->rents*sizeof(struct rrec));
+}
+
+static COLD int dumpring(struct common *c)
+{
+	int fd;
+	unsigned long long n;
+	unsigned long long head;
+	size_t len;
+	struct stat stb;
+	struct rhdr *h;
+	struct rrec r;
+	struct rrec *rec;
+	static const char *name[3]={"all","low","poll"};
+
+	if((fd=open(c->dump,O_RDONLY|O_CLOEXEC))==-1)
+	{
+		fprintf(stderr,"Unable to open %s\n",c->dump);
+		return 1;
+	}
+	if(fstat(fd,&stb)||stb.st_size<sizeof(struct rhdr)||
+	    (h=mmap(NULL,stb.st_size,PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED)
+	{
+		close(fd);
+		fprintf(stderr,"Unable to map %s\n",c->dump);
+		return 1;
+	}
+	close(fd);
+
+	len=sizeof(struct rhdr)+(size_t)h->entries*sizeof(struct rrec);
+	if(h->magic!=RINGMAGIC||h->version!=RINGVERS||
+	    h->size!=sizeof(struct rrec)||!h->entries||len>stb.st_size)
+	{
+		fprintf(stderr,"Invalid recording %s\n",c->dump);
+		munmap(h,stb.st_size);
+		return 1;
+	}
+	rec=(struct rrec *)(h+1);
+
+	printf("# record unit type level mono raw real assert assert-seq "
+		"clear clear-seq\n");
+
+	head=__atomic_load_n(&h->head,__ATOMIC_ACQUIRE);
+	for(n=head>h->entries?head-h->entries:0;n<head;n++)
+	{
+		memcpy(&r,&rec[n%h->entries],sizeof(r));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(r.nr!=(unsigned int)(n+1)||
+		    r.nr!=__atomic_load_n(&rec[n%h->entries].nr,
+			__ATOMIC_RELAXED))continue;
+		printf("%llu %d %c %s %lld %lld %lld %lld %u %lld %u\n",n,
+			r.unit,r.type,r.level<3?name[r.level]:"?",r.mono,r.raw,
+			r.real,r.assert,r.aseq,r.clear,r.cseq);
+	}
+
+	munmap(h,stb.st_size);
+	return 0;
+}
+
+static COLD void rcopy(void *dst,void *src,int len,unsigned int *seq)
+{
+	unsigned int s;
+
+	do
+	{
+		while((s=__atomic_load_n(seq,__ATOMIC_ACQUIRE))&1)sched_yield();
+		memcpy(dst,src,len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(s!=__atomic_load_n(seq,__ATOMIC_RELAXED));
+}
+
+static COLD int showstat(struct common *c)
+{
+	int i;
+	int fd;
+	struct shmstat *s;
+	struct shmpps pps;
+	struct shmtimer tmr;
+
+	if((fd=shm_open(c->shm,O_RDONLY|O_CLOEXEC,0))==-1)
+	{
+		fprintf(stderr,"No statistics found at %s\n",c->shm);
+		return 1;
+	}
+	s=mmap(NULL,sizeof(struct shmstat),PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(s==MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	if(__atomic_load_n(&s->magic,__ATOMIC_ACQUIRE)!=SHMMAGIC||
+	    s->version!=SHMVERS||s->units<1||s->units>MAXUNITS)
+	{
+		fprintf(stderr,"Invalid statistics at %s\n",c->shm);
+		munmap(s,sizeof(struct shmstat));
+		return 1;
+	}
+
+	printf("unidled pid %d%s\n",s->pid,
+		kill(s->pid,0)&&errno==ESRCH?" (not running)":"");
+	if(s->moved)printf("task repairs %lu\n",
+		__atomic_load_n(&s->moved,__ATOMIC_RELAXED));
+
+	for(i=0;i<s->units;i++)
+	{
+		rcopy(&pps,&s->unit[i].pps,sizeof(pps),&s->unit[i].pps.seq);
+		rcopy(&tmr,&s->unit[i].tmr,sizeof(tmr),&s->unit[i].tmr.seq);
+
+		printf("\n%.63s (core %d) %s\n",s->unit[i].dev,s->unit[i].cpu,
+			pps.locked?"locked":"unlocked");
+		printf("pulses seen     %12lu\n",pps.pulses);
+		printf("pulses rejected %12lu\n",pps.rejected);
+		printf("timeouts        %12lu\n",pps.timeouts);
+		printf("relocks         %12lu\n",pps.relocks);
+		printf("pll restarts    %12lu\n",pps.resets);
+		printf("attached        %12lu\n",pps.attached);
+		if(s->unit[i].irq)printf("irq %d repairs  %12lu\n",
+			s->unit[i].irq,__atomic_load_n(&s->unit[i].irqfix,
+			__ATOMIC_RELAXED));
+		if(pps.width)printf("pulse width     last %ldns  implausible %lu\n",
+			pps.width,pps.wbad);
+		if(pps.serr.cnt)printf("steering error  last %ldns  min %ldns"
+			"  avg %lldns  max %ldns\n",pps.steer,pps.serr.min,
+			pps.serr.sum/(long long)pps.serr.cnt,pps.serr.max);
+		printf("phase switches  %12lu\n",tmr.switches);
+		printf("failed writes   %12lu\n",tmr.failed);
+		printf("holdover pulses %12lu\n",tmr.holdover);
+		printf("holdover ends   %12lu\n",tmr.degraded);
+		if(tmr.late.cnt)printf("timer lateness  last %ldns  min %ldns"
+			"  avg %lldns  max %ldns\n",tmr.last,tmr.late.min,
+			tmr.late.sum/(long long)tmr.late.cnt,tmr.late.max);
+	}
+
+	munmap(s,sizeof(struct shmstat));
+	return 0;
+}
+
+static COLD int openctl(struct common *c,struct idle *t)
+{
+	pthread_mutexattr_t attr;
+
+	t->thres=c->thres;
+	t->level=LVL_POLL;
+	t->qos=c->qos;
+	memset(t->req,0,sizeof(t->req));
+	memset(t->ts,0,sizeof(t->ts));
+	t->cost=NULL;
+
+	if(t->cpu==-1)t->max=0;
+	else if(t->qos&&!openqos(t->cpu,t->thres,t->fd))t->qos=1;
+	else if(t->qos==1)
+	{
+		fprintf(stderr,"Unable to access resume latency pm qos\n");
+		return -1;
+	}
+	else
+	{
+		t->qos=0;
+
+		if(UNLIKELY(buildlist(t->cpu,&t->max)))
+		{
+			fprintf(stderr,"Unable to collect power states\n");
+			return -1;
+		}
+
+		if(c->prf||c->pof)
+			if(UNLIKELY(getlimit(t->cpu,t->max,t->thres,&t->high)))
+		{
+			fprintf(stderr,"Unable to get intermediate threshold\n");
+			return -1;
+		}
+	}
+
+	if(t->qos!=1&&UNLIKELY(openidle(t->max,t->fd)))
+	{
+		fprintf(stderr,"Unable to access idle controls\n");
+		return -1;
+	}
+
+	if(pthread_mutexattr_init(&attr)||
+	    pthread_mutexattr_setprotocol(&attr,PTHREAD_PRIO_INHERIT)||
+	    pthread_mutex_init(&t->mtx,&attr))
+	{
+		fprintf(stderr,"Unable to create idle arbiter\n");
+		return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	t->since=mono();
+	setlevel(t,LVL_ALL);
+	memset(t->dwell,0,sizeof(t->dwell));
+
+	return 0;
+}
+
+static COLD void closectl(struct idle *t)
+{
+	setlevel(t,LVL_ALL);
+
+	if(t->qos==1)close(t->fd[0]);
+	else closeidle(t->max,t->fd);
+	pthread_mutex_destroy(&t->mtx);
+}
+
+static COLD int mkidle(struct common *c)
+{
+	int i;
+	int j;
+	int k;
+
+	for(i=0;i<c->units;i++)
+		for(c->unit[i].nidle=0,k=0;k<(c->all?1:c->unit[i].ncpu);k++)
+	{
+		for(j=0;j<c->idles;j++)
+			if(c->all||c->idle[j].cpu==c->unit[i].cpus[k])break;
+		if(j==c->idles)
+		{
+			if(UNLIKELY(j==MAXCORES))
+			{
+				fprintf(stderr,"Too many cores\n");
+				return -1;
+			}
+			c->idle[j].cpu=c->all?-1:c->unit[i].cpus[k];
+			if(UNLIKELY(openctl(c,&c->idle[j])))return -1;
+			c->idles++;
+		}
+		c->unit[i].idle[c->unit[i].nidle++]=&c->idle[j];
+		c->unit[i].level=LVL_ALL;
+		c->idle[j].req[LVL_ALL]++;
+	}
+
+	return 0;
+}
+
+#ifndef SIMULATE
+
+static COLD int findirq(char *dev)
+{
+	int fd;
+	int l;
+	long v;
+	char *p;
+	char *end;
+	char path[PATH_MAX];
+	char bfr[PATH_MAX+128];
+
+	/* e.g. /dev/gps0 -> /dev/ttyS0 -> /sys/class/tty/ttyS0/irq */
+
+	if(!realpath(dev,path)||!(p=strrchr(path,'/')))return -1;
+	sprintf(bfr,"%s/sys/class/tty/%s/irq",root,p+1);
+	if((fd=open(bfr,O_RDONLY|O_CLOEXEC))==-1)return -1;
+	l=read(fd,bfr,sizeof(bfr)-1);
+	close(fd);
+	if(l<1)return -1;
+	bfr[l]=0;
+	v=strtol(bfr,&end,10);
+	if(end==bfr||(*end&&*end!='\n')||v<1||v>INT_MAX)return -1;
+	return (int)v;
+}
+
+static COLD int irqthread(struct unit *u,pid_t pid)
+{
+	int r=0;
+	cpu_set_t set;
+	struct sched_param param;
+
+	if(sched_getparam(pid,&param)||sched_getscheduler(pid)!=SCHED_FIFO||
+	    param.sched_priority!=u->c->iprio)
+	{
+		memset(&param,0,sizeof(param));
+		param.sched_priority=u->c->iprio;
+		if(!sched_setscheduler(pid,SCHED_FIFO,&param))r=1;
+	}
+
+	if(sched_getaffinity(pid,sizeof(set),&set)||CPU_COUNT(&set)!=1||
+	    !CPU_ISSET(u->cpu,&set))
+	{
+		CPU_ZERO(&set);
+		CPU_SET(u->cpu,&set);
+		if(!sched_setaffinity(pid,sizeof(set),&set))r=1;
+	}
+
+	return r;
+}
+
+static COLD void irqcheck(struct common *c)
+{
+	int i;
+	int l;
+	int n;
+	int fd;
+	int fix;
+	long v;
+	char *end;
+	DIR *d;
+	struct dirent *e;
+	struct unit *u;
+	char bfr[512];
+	char name[32];
+	char comm[32];
+
+	for(i=0;i<c->units;i++)if((u=&c->unit[i])->irq>0)
+	{
+		/* the interrupt itself */
+
+		fix=0;
+		sprintf(bfr,"%s/proc/irq/%d/smp_affinity_list",root,u->irq);
+		if((fd=open(bfr,O_RDWR|O_CLOEXEC))!=-1)
+		{
+			l=pread(fd,bfr,sizeof(bfr)-1,0);
+			bfr[l>0?l:0]=0;
+			v=strtol(bfr,&end,10);
+			if(end==bfr||(*end&&*end!='\n')||v!=u->cpu)
+			{
+				l=sprintf(bfr,"%d\n",u->cpu);
+				if(pwrite(fd,bfr,l,0)==l)fix=1;
+			}
+			close(fd);
+		}
+
+		/* "irq/<n>-<name>" kernel threads, recreated on request_irq */
+
+		n=sprintf(name,"irq/%d-",u->irq);
+		sprintf(bfr,"%s/proc",root);
+		if((d=opendir(bfr)))
+		{
+			while((e=readdir(d)))
+			{
+				v=strtol(e->d_name,&end,10);
+				if(end==e->d_name||*end||v<1)continue;
+				sprintf(bfr,"%s/proc/%ld/comm",root,v);
+				if(readname(bfr,comm,sizeof(comm))||
+				    strncmp(comm,name,n))continue;
+				fix|=irqthread(u,(pid_t)v);
+			}
+			closedir(d);
+		}
+
+		if(fix&&u->irqset)
+			__atomic_add_fetch(&u->sh->irqfix,1,__ATOMIC_RELAXED);
+		u->irqset=1;
+	}
+}
+
+static COLD void managed(struct common *c,cpu_set_t *set)
+{
+	int i;
+	int j;
+
+	CPU_ZERO(set);
+	for(i=0;i<c->units;i++)for(j=0;j<c->unit[i].ncpu;j++)
+		CPU_SET(c->unit[i].cpus[j],set);
+}
+
+static COLD int place(struct common *c,pid_t pid,int prio)
+{
+	int r=0;
+	long v;
+	char *end;
+	DIR *d;
+	struct dirent *e;
+	cpu_set_t set;
+	cpu_set_t cores;
+	struct sched_param param;
+	char bfr[512];
+
+	managed(c,&cores);
+
+	sprintf(bfr,"%s/proc/%d/task",root,pid);
+	if(!(d=opendir(bfr)))return r;
+	while((e=readdir(d)))
+	{
+		v=strtol(e->d_name,&end,10);
+		if(end==e->d_name||*end||v<1)continue;
+
+		if(sched_getparam((pid_t)v,&param)||
+		    sched_getscheduler((pid_t)v)!=SCHED_FIFO||
+		    param.sched_priority!=prio)
+		{
+			memset(&param,0,sizeof(param));
+			param.sched_priority=prio;
+			if(!sched_setscheduler((pid_t)v,SCHED_FIFO,&param))r=1;
+		}
+
+		if(sched_getaffinity((pid_t)v,sizeof(set),&set)||
+		    CPU_EQUAL(&set,&cores))continue;
+		if(!sched_setaffinity((pid_t)v,sizeof(cores),&cores))r=1;
+	}
+	closedir(d);
+
+	return r;
+}
+
+static COLD void taskcheck(struct common *c)
+{
+	int i;
+	int fix=0;
+	long v;
+	char *end;
+	DIR *d;
+	struct dirent *e;
+	char bfr[512];
+	char comm[32];
+
+	sprintf(bfr,"%s/proc",root);
+	if(!(d=opendir(bfr)))return;
+	while((e=readdir(d)))
+	{
+		v=strtol(e->d_name,&end,10);
+		if(end==e->d_name||*end||v<1||v==getpid())continue;
+
+		for(i=0;i<c->tasks;i++)if(c->task[i].pid==v)break;
+		if(i==c->tasks)
+		{
+			sprintf(bfr,"%s/proc/%ld/comm",root,v);
+			if(readname(bfr,comm,sizeof(comm)))continue;
+			for(i=0;i<c->tasks;i++)if(c->task[i].name&&
+			    !strcmp(c->task[i].name,comm))break;
+			if(i==c->tasks)continue;
+		}
+
+		fix|=place(c,(pid_t)v,c->task[i].prio);
+	}
+	closedir(d);
+
+	if(fix&&c->tset)__atomic_add_fetch(&c->stat->moved,1,__ATOMIC_RELAXED);
+	c->tset=1;
+}
+
+static COLD void rmidle(struct common *c)
+{
+	int i;
+
+	for(i=0;i<c->idles;i++)closectl(&c->idle[i]);
+	c->idles=0;
+}
+
+static COLD void current(struct common *c,struct tune *t)
+{
+	t->thres=c->thres;
+	t->poh=c->poh/1000000;
+	t->pof=c->pof/1000000;
+	t->prf=c->prf/1000000;
+	t->prh=c->prh/1000000;
+	t->all=c->all;
+	t->qos=c->qos!=-1||c->all?c->qos:c->idle[0].qos;
+}
+
+static COLD void apply(struct common *c,struct tune *t)
+{
+	int i;
+	struct unit *u;
+
+	c->thres=t->thres;
+	c->all=t->all;
+	c->qos=t->qos;
+	c->poh=t->poh*1000000;
+	c->pof=t->pof*1000000;
+	c->prf=t->prf*1000000;
+	c->prh=t->prh*1000000;
+	c->prl=1000000000-c->pof-c->poh-c->prh-c->prf;
+
+	/* the adaptive windows restart from the new limits */
+
+	for(i=0;i<c->units;i++)
+	{
+		u=&c->unit[i];
+		u->prf=u->wprf=u->tprf=c->prf;
+		u->pof=u->tpof=c->pof;
+		u->tprl=c->prl;
+		__atomic_store_n(&u->win,((long long)c->prf<<32)|c->pof,
+			__ATOMIC_SEQ_CST);
+		memset(&u->pre,0,sizeof(u->pre));
+		memset(&u->post,0,sizeof(u->post));
+	}
+}
+
+static COLD int settings(char *cmd,struct tune *t)
+{
+	long v;
+	char *key;
+	char *end;
+	char *save;
+
+	for(key=strtok_r(cmd," \t\n",&save);key;
+		key=strtok_r(NULL," \t\n",&save))
+	{
+		if(!key[0]||key[1]!='=')return -1;
+
+		if(key[0]=='b')
+		{
+			if(!strcmp(key+2,"qos"))t->qos=1;
+			else if(!strcmp(key+2,"state"))t->qos=0;
+			else return -1;
+			continue;
+		}
+
+		v=strtol(key+2,&end,10);
+		if(key+2==end||*end)return -1;
+
+		switch(key[0])
+		{
+		case 't':
+			if(v<1||v>1000)return -1;
+			t->thres=(int)v;
+			break;
+
+		case 'P':
+			if(v<1||v>1000)return -1;
+			t->pof=(int)v;
+			break;
+
+		case 'p':
+			if(v<0||v>1000)return -1;
+			t->prf=(int)v;
+			break;
+
+		case 'l':
+			if(v<0||v>1000)return -1;
+			t->prh=(int)v;
+			break;
+
+		case 'L':
+			if(v<0||v>1000)return -1;
+			t->poh=(int)v;
+			break;
+
+		case 'a':
+			if(v<0||v>1)return -1;
+			t->all=(int)v;
+			break;
+
+		default:return -1;
+		}
+	}
+
+	if(t->poh+t->pof+t->prf+t->prh>1000)return -1;
+	return 0;
+}
+
+static COLD void control(struct common *c)
+{
+	int l;
+	socklen_t alen;
+	struct tune t;
+	struct tune cur;
+	struct sockaddr_un addr;
+	char bfr[256];
+	static const char *name[3]={"auto","state","qos"};
+
+	alen=sizeof(addr);
+	if((l=recvfrom(c->ctl,bfr,sizeof(bfr)-1,MSG_DONTWAIT,
+		(struct sockaddr *)&addr,&alen))<0)return;
+	bfr[l]=0;
+
+	current(c,&cur);
+	t=c->pend?c->next:cur;
+
+	if(settings(bfr,&t))l=sprintf(bfr,"error: invalid settings\n");
+	else
+	{
+		/* applied by the event loop at the next pulse boundary */
+
+		if(memcmp(&t,&cur,sizeof(t)))
+		{
+			if(!c->pend)c->pcycle=c->unit[0].cycle;
+			c->next=t;
+			c->pend=1;
+		}
+		else c->pend=0;
+
+		l=sprintf(bfr,"t=%d p=%d P=%d l=%d L=%d a=%d b=%s%s\n",
+			t.thres,t.prf,t.pof,t.prh,t.poh,t.all,name[t.qos+1],
+			c->pend?" (pending)":"");
+	}
+
+	sendto(c->ctl,bfr,l,MSG_DONTWAIT,(struct sockaddr *)&addr,alen);
+}
+
+static COLD int retune(struct common *c)
+{
+	int i;
+	struct tune old;
+
+	/* mkidle() resets all devices, thus never with a window open */
+
+	for(i=0;i<c->units;i++)if(__atomic_load_n(&c->unit[i].level,
+		__ATOMIC_RELAXED)!=LVL_ALL)return 0;
+
+	/* a window may have opened until the other loops are parked */
+
+	quiesce(c);
+	for(i=0;i<c->units;i++)if(c->unit[i].level!=LVL_ALL)
+	{
+		resume(c);
+		return 0;
+	}
+
+	current(c,&old);
+	c->pend=0;
+
+	rmidle(c);
+	apply(c,&c->next);
+	if(UNLIKELY(mkidle(c)))
+	{
+		fprintf(stderr,"Unable to apply settings, reverting\n");
+		rmidle(c);
+		apply(c,&old);
+		if(UNLIKELY(mkidle(c)))
+		{
+			resume(c);
+			return -1;
+		}
+	}
+
+	resume(c);
+
+	if(c->meter)newsched(c);
+	return 0;
+}
+
+static COLD int opensock(struct common *c)
+{
+	int r;
+	mode_t mask;
+	struct sockaddr_un addr;
+
+	if((c->ctl=socket(AF_UNIX,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0))
+		==-1)return -1;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path,c->sock);
+	unlink(c->sock);
+
+	mask=umask(077);
+	r=bind(c->ctl,(struct sockaddr *)&addr,sizeof(addr));
+	umask(mask);
+
+	if(r)
+	{
+		close(c->ctl);
+		c->ctl=-1;
 		return -1;
 	}
+	return 0;
+}
+
+static COLD int client(struct common *c)
+{
+	int s;
+	int l;
+	struct pollfd p;
+	struct sockaddr_un addr;
+	char bfr[256];
+
+	if((s=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0))==-1)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	/* autobind, so the daemon can reply */
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	if(bind(s,(struct sockaddr *)&addr,sizeof(sa_family_t)))
+	{
+		perror("bind");
+		close(s);
+		return 1;
+	}
+
+	strcpy(addr.sun_path,c->sock);
+	if(sendto(s,c->tell,strlen(c->tell),0,(struct sockaddr *)&addr,
+		sizeof(addr))==-1)
+	{
+		fprintf(stderr,"Unable to contact %s\n",c->sock);
+		close(s);
+		return 1;
+	}
+
+	p.fd=s;
+	p.events=POLLIN;
+	if(poll(&p,1,2000)!=1||(l=recv(s,bfr,sizeof(bfr),0))<1)
+	{
+		fprintf(stderr,"No reply from %s\n",c->sock);
+		close(s);
+		return 1;
+	}
+	close(s);
+
+	fwrite(bfr,1,l,stdout);
+	return strncmp(bfr,"error",5)?0:1;
+}
+
+static int cmpll(const void *a,const void *b)
+{
+	long long x=*(const long long *)a;
+	long long y=*(const long long *)b;
+
+	return x<y?-1:x>y?1:0;
+}
+
+static COLD int bench(struct common *c)
+{
+	int i;
+	int lvl;
+	int tfd;
+	unsigned long k;
+	unsigned long sw;
+	long long s;
+	long long at;
+	long long now;
+	long long per;
+	long long end;
+	uint64_t dummy;
+	sigset_t set;
+	struct pollfd p[2];
+	struct itimerspec it;
+	struct unit *u=&c->unit[0];
+	struct shmunit sh;
+	struct lhist cost[3];
+	struct lhist late[3];
+
+	setsigs();
+
+	if(mlockall(MCL_CURRENT|MCL_FUTURE)||setcpu(u->cpu)||
+	    setprio(c->prio))
+	{
+		fprintf(stderr,"Unable to set affinity and realtime priority\n");
+		return 1;
+	}
+
+	/* the windows are scaled to the pulse period, the pll starts on it */
+
+	per=1000000000LL/c->rate;
+	c->prf/=c->rate;
+	c->pof/=c->rate;
+	c->poh/=c->rate;
+	c->prh/=c->rate;
+	u->prf=u->wprf=u->tprf=c->prf;
+	u->pof=u->tpof=c->pof;
+	u->win=((long long)c->prf<<32)|c->pof;
+	u->per=per;
+
+	memset(&sh,0,sizeof(sh));
+	u->sh=&sh;
+	memset(cost,0,sizeof(cost));
+	memset(late,0,sizeof(late));
+
+	if(mkidle(c))return 1;
+	for(i=0;i<u->nidle;i++)u->idle[i]->cost=cost;
+
+	if((u->tfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC))==-1||
+	    (tfd=timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC))==-1)
+	{
+		perror("timerfd_create");
+		if(u->tfd!=-1)close(u->tfd);
+		rmidle(c);
+		return 1;
+	}
+
+	/* a synthetic pulse drives the unchanged pll and phase switches */
+
+	memset(&it,0,sizeof(it));
+	memset(p,0,sizeof(p));
+	p[0].fd=u->tfd;
+	p[0].events=POLLIN;
+	p[1].fd=tfd;
+	p[1].events=POLLIN;
+
+	s=(mono()/1000000000LL+2)*1000000000LL;
+	end=s+c->bench*1000000000LL;
+	at=s;
+	it.it_value.tv_sec=at/1000000000;
+	it.it_value.tv_nsec=at%1000000000;
+	timerfd_settime(tfd,TFD_TIMER_ABSTIME,&it,NULL);
+
+	for(k=0;at<end;)
+	{
+		sigpending(&set);
+		if(sigismember(&set,SIGINT)||sigismember(&set,SIGTERM)||
+		    sigismember(&set,SIGHUP)||sigismember(&set,SIGQUIT))break;
+		if(poll(p,2,-1)<1)continue;
+
+		if((p[0].revents&POLLIN)&&
+		    read(u->tfd,&dummy,sizeof(dummy))==sizeof(dummy))
+		{
+			lvl=u->level;
+			sw=sh.tmr.switches;
+			expire(u,mono());
+			if(sh.tmr.switches!=sw)lhput(&late[lvl],sh.tmr.last);
+		}
+
+		if((p[1].revents&POLLIN)&&
+		    read(tfd,&dummy,sizeof(dummy))==sizeof(dummy))
+		{
+			now=mono();
+			track(u,now,now,at);
+			k++;
+			at=s+k*per;
+			it.it_value.tv_sec=at/1000000000;
+			it.it_value.tv_nsec=at%1000000000;
+			timerfd_settime(tfd,TFD_TIMER_ABSTIME,&it,NULL);
+		}
+	}
+
+	close(tfd);
+	close(u->tfd);
+	rmidle(c);
+
+	printf("%s backend, %lu periods at %dHz on %d core(s)\n",
+		c->all?"dma latency":u->idle[0]->qos?"pm qos":"idle state",
+		k,c->rate,c->all?1:u->nidle);
+	printf("backend cost (ns):\n");
+	lhtab(stdout,"to phase",cost);
+	printf("timer lateness (ns):\n");
+	lhtab(stdout,"idle phase",late);
+	return 0;
+}
+
+static COLD int disable(int (*fd)[32],int *cnt,int ncpu,int k)
+{
+	int i;
+	int j;
+
+	for(j=0;j<ncpu;j++)for(i=0;i<cnt[j];i++)
+		if(pwrite(fd[j][i],i>=k?"1\n":"0\n",2,0)!=2)return -1;
+	return 0;
+}
+
+static COLD int calibrate(struct common *c)
+{
+	int i;
+	int j;
+	int k;
+	int m;
+	int n;
+	int e;
+	int max;
+	int best=0;
+	int r=1;
+	int ppsfd=-1;
+	unsigned int seq;
+	long long ts;
+	long long last;
+	long long mean;
+	long long *dev=NULL;
+	long long *lat=NULL;
+	unsigned long long val;
+	unsigned long long lim[32];
+	struct pps_ktime *t;
+	struct pps_fdata data;
+	sigset_t set;
+	struct unit *u=&c->unit[0];
+	int cnt[MAXCORES];
+	int fd[MAXCORES][32];
+	char org[MAXCORES][32];
+	char name[32][16];
+	char bfr[2];
+
+	setsigs();
+
+	if(setcpu(u->cpu)||setprio(c->prio))
+	{
+		fprintf(stderr,"Unable to set affinity and realtime priority\n");
+		return 1;
+	}
+
+	/* remember the disable files as found, they are restored at the end */
 
-	if(UNLIKELY(setcpu(c->cpu)))
+	for(j=0;j<u->ncpu;j++)cnt[j]=0;
+	for(j=0;j<u->ncpu;j++)
 	{
-		fprintf(stderr,"Unable to set affinity to selected core\n");
-		return -1;
+		if(buildlist(u->cpus[j],&cnt[j]))
+		{
+			fprintf(stderr,"Unable to access idle states of core %d\n",
+				u->cpus[j]);
+			goto out;
+		}
+		for(i=0;i<cnt[j];i++)
+		{
+			if((fd[j][i]=open(idlelist[i],O_RDWR|O_CLOEXEC))==-1||
+			    pread(fd[j][i],&org[j][i],1,0)!=1)
+			{
+				if(fd[j][i]!=-1)close(fd[j][i]);
+				fprintf(stderr,"Unable to access %s\n",
+					idlelist[i]);
+				cnt[j]=i;
+				goto out;
+			}
+			if(j)continue;
+			k=strlen(idlelist[i])-7;
+			strcpy(idlelist[i]+k,"latency");
+			if((m=open(idlelist[i],O_RDONLY|O_CLOEXEC))==-1||
+			    counter(m,&lim[i]))lim[i]=0;
+			if(m!=-1)close(m);
+			strcpy(idlelist[i]+k,"name");
+			if(readname(idlelist[i],name[i],sizeof(name[0])))
+				sprintf(name[i],"state%d",i);
+		}
 	}
+	max=cnt[0];
 
-	if(UNLIKELY(setprio(c->prio)))
+	if((ppsfd=openpps(u->dev,c->edge?c->edge:1,NULL))==-1)
 	{
-		fprintf(stderr,"Unable to set realtime priority\n");
-		return -1;
+		fprintf(stderr,"Unable to access pps device for %s\n",u->dev);
+		goto out;
+	}
+
+	if(!(dev=malloc(c->cal*sizeof(long long)))||
+	    !(lat=malloc(c->cal*sizeof(long long))))
+	{
+		perror("malloc");
+		goto out;
 	}
 
-	memset(&sev,0,sizeof(sev));
-	sev.sigev_notify=SIGEV_THREAD;
-	sev.sigev_value.sival_ptr=c;
- 	sev.sigev_notify_function=timer;
+	memset(&data,0,sizeof(data));
+	data.timeout.sec=2;
+	t=c->edge==2?&data.info.clear_tu:&data.info.assert_tu;
+
+	printf("%-11s %7s %9s %9s %9s %9s %9s %9s\n","deepest","pulses",
+		"jit 50%","jit 99%","jit max","lat 50%","lat 99%","lat max");
+
+	for(k=max;k>0;k--)
+	{
+		if(disable(fd,cnt,u->ncpu,k))
+		{
+			fprintf(stderr,"Unable to modify idle states\n");
+			goto out;
+		}
+
+		/* the first pulse after a change is not measured */
+
+		for(seq=0,last=0,n=0,m=-1;m<c->cal;)
+		{
+			sigpending(&set);
+			if(sigismember(&set,SIGINT)||sigismember(&set,SIGTERM)||
+			    sigismember(&set,SIGHUP)||sigismember(&set,SIGQUIT))
+				goto out;
+
+			if(ioctl(ppsfd,PPS_FETCH,&data)==-1)
+			{
+				if(errno==ETIMEDOUT)last=0;
+				continue;
+			}
+			ts=real();
+			if(c->edge==2?data.info.clear_sequence==seq:
+			    data.info.assert_sequence==seq)continue;
+			seq=c->edge==2?data.info.clear_sequence:
+				data.info.assert_sequence;
+
+			if(m++<0)
+			{
+				last=t->sec*1000000000LL+t->nsec;
+				continue;
+			}
+			lat[m-1]=ts-t->sec*1000000000LL-t->nsec;
+			ts=t->sec*1000000000LL+t->nsec;
+			if(last&&ts-last>500000000LL&&ts-last<1500000000LL)
+				dev[n++]=ts-last;
+			last=ts;
+		}
+
+		/* interval jitter is measured against the mean interval */
+
+		for(mean=0,i=0;i<n;i++)mean+=dev[i];
+		if(n)mean/=n;
+		for(i=0;i<n;i++)dev[i]=llabs(dev[i]-mean);
+		qsort(dev,n,sizeof(long long),cmpll);
+		qsort(lat,c->cal,sizeof(long long),cmpll);
 
-	if(c->all)c->max=0;
+		printf("%-11s %7d %9lld %9lld %9lld %9lld %9lld %9lld\n",
+			name[k-1],n,n?dev[n/2]:-1,n?dev[(n*99)/100]:-1,
+			n?dev[n-1]:-1,lat[c->cal/2],lat[(c->cal*99)/100],
+			lat[c->cal-1]);
+		fflush(stdout);
+
+		if(!best&&n&&dev[(n*99)/100]<=c->target)best=k;
+	}
+
+	if(!best)printf("no idle state set meets %dns jitter\n",c->target);
 	else
 	{
-		if(UNLIKELY(buildlist(c->cpu,&c->max)))
+		for(val=1,i=0;i<best;i++)if(lim[i]>val)val=lim[i];
+		if(best==max)printf("all idle states meet %dns jitter, "
+			"no lower latency phase required\n",c->target);
+		else if(val<lim[best]&&val<=1000)printf("states up to %s meet "
+			"%dns jitter, use -t %llu\n",name[best-1],c->target,val);
+		else printf("states up to %s meet %dns jitter, advertised "
+			"latencies don't allow to select them with -t\n",
+			name[best-1],c->target);
+	}
+	r=0;
+
+out:	for(e=0,j=0;j<u->ncpu;j++)for(i=0;i<cnt[j];i++)
+	{
+		bfr[0]=org[j][i];
+		bfr[1]='\n';
+		if(pwrite(fd[j][i],bfr,2,0)!=2)e=1;
+		close(fd[j][i]);
+	}
+	if(e)
+	{
+		fprintf(stderr,"Unable to restore idle states\n");
+		r=1;
+	}
+	if(ppsfd!=-1)close(ppsfd);
+	if(dev)free(dev);
+	if(lat)free(lat);
+	return r;
+}
+
+#endif
+
+#ifndef SIMULATE
+
+static HOT int run(struct unit *g)
+{
+	int i;
+	int n;
+	int stop=0;
+	uint64_t dummy;
+	FILE *fp;
+	struct unit *u;
+	struct fmsg msg;
+	struct pps_fdata data;
+	struct signalfd_siginfo si;
+	struct epoll_event ev[EVMAX];
+	struct common *c=g->c;
+
+	memset(&data,0,sizeof(data));
+
+	for(i=0;i<c->units;i++)if(c->unit[i].cpu==g->cpu)ready(&c->unit[i]);
+
+	while(1)
+	{
+		if(UNLIKELY((n=epoll_wait(g->epfd,ev,EVMAX,-1))<1))continue;
+
+		/* the main loop retunes while all other loops are parked */
+
+		if(g!=c->unit&&
+		    UNLIKELY(__atomic_load_n(&c->quiet,__ATOMIC_ACQUIRE)))
 		{
-			fprintf(stderr,"Unable to collect power states\n");
-			return -1;
+			park(c);
+			continue;
 		}
 
-		if(c->prf||c->pof)
-			if(UNLIKELY(getlimit(c->cpu,c->max,c->thres,&c->high)))
+		for(i=0;i<n;i++)
 		{
-			fprintf(stderr,"Unable to get intermediate threshold\n");
-			return -1;
+			u=&c->unit[ev[i].data.u32>>8];
+
+			switch(ev[i].data.u32&0xff)
+			{
+			case EV_TIMER:
+				if(LIKELY(read(u->tfd,&dummy,sizeof(dummy))==
+					sizeof(dummy)))expire(u,mono());
+				break;
+
+			case EV_PPS:
+				if(UNLIKELY(ioctl(u->ppsfd,PPS_FETCH,&data)==-1))
+					break;
+				if(UNLIKELY(data.info.assert_sequence==u->aseq&&
+				    data.info.clear_sequence==u->cseq))break;
+				u->aseq=data.info.assert_sequence;
+				u->cseq=data.info.clear_sequence;
+				process(u,&data.info,mono(),real());
+				watch(u);
+				ready(u);
+				break;
+
+			case EV_NET:
+				receive(u);
+				watch(u);
+				ready(u);
+				break;
+
+			case EV_WATCH:
+				if(UNLIKELY(read(u->wfd,&dummy,sizeof(dummy))!=
+					sizeof(dummy)))break;
+				dropout(u);
+				watch(u);
+				ready(u);
+				break;
+
+			case EV_PIPE:
+				if(UNLIKELY(read(u->pfd[0],&msg,sizeof(msg))!=
+					sizeof(msg)))break;
+				if(UNLIKELY(msg.timeout))dropout(u);
+				else process(u,&msg.info,msg.now,msg.rt);
+				ready(u);
+				break;
+
+			case EV_SIGNAL:
+				if(UNLIKELY(read(c->sfd,&si,sizeof(si))!=
+					sizeof(si)))break;
+				if(si.ssi_signo!=SIGUSR2)
+				{
+					stop=1;
+					break;
+				}
+				if(c->hist)
+				{
+					if((fp=fopen(c->hist,"we")))
+					{
+						dumplat(c,fp);
+						if(c->meter)dumpres(c,fp);
+						fclose(fp);
+					}
+				}
+				else if(c->fg)
+				{
+					dumplat(c,stderr);
+					if(c->meter)dumpres(c,stderr);
+				}
+				break;
+
+			case EV_METER:
+				if(LIKELY(read(c->mfd,&dummy,sizeof(dummy))==
+					sizeof(dummy)))c->mdue=1;
+				break;
+
+			case EV_CHECK:
+				if(LIKELY(read(c->cfd,&dummy,sizeof(dummy))==
+					sizeof(dummy)))c->cdue=1;
+				break;
+
+			case EV_CTL:
+				control(c);
+				break;
+
+			case EV_UEVENT:
+				uevent(c);
+				break;
+
+			case EV_QUIET:
+				break;
+
+			default:stop=1;
+				break;
+			}
+		}
+
+		if(g==c->unit&&UNLIKELY(c->mdue|c->cdue)&&c->unit[0].level==LVL_ALL)
+		{
+			if(c->mdue)sample(c);
+			if(c->cdue&&c->iprio)irqcheck(c);
+			if(c->cdue&&c->tasks)taskcheck(c);
+			c->mdue=c->cdue=0;
+		}
+
+		if(g==c->unit&&UNLIKELY(c->pend)&&(c->unit[0].first||
+		    c->unit[0].cycle!=c->pcycle)&&UNLIKELY(retune(c)))
+		{
+			fprintf(stderr,"Unable to restore settings\n");
+			stop=1;
 		}
+
+		if(UNLIKELY(stop))return 0;
+	}
+}
+
+static HOT void *loop(void *arg)
+{
+	run(arg);
+	return NULL;
+}
+
+#endif
+
+static COLD int prepare(struct common *c)
+{
+	int i;
+#ifndef SIMULATE
+	int j;
+	int n;
+	FILE *fp;
+	sigset_t set;
+	struct unit *u;
+	struct unit *g;
+	struct itimerspec its;
+
+	setsigs();
+
+	if(UNLIKELY(setcpu(c->unit[0].cpu)))
+	{
+		fprintf(stderr,"Unable to set affinity to selected core\n");
+		return -1;
 	}
 
-	if(UNLIKELY(openidle(c->max)))
+	if(UNLIKELY(setprio(c->prio)))
 	{
-		fprintf(stderr,"Unable to access idle controls\n");
+		fprintf(stderr,"Unable to set realtime priority\n");
+		return -1;
+	}
+#endif
+
+	if(UNLIKELY(mkidle(c)))return -1;
+
+	if(c->meter&&UNLIKELY(openmeter(c)))
+	{
+		fprintf(stderr,"Unable to access idle state or energy counters\n");
+		return -1;
+	}
+
+#ifdef SIMULATE
+	for(i=0;i<c->units;i++)if(!(c->unit[i].trace=fopen(c->unit[i].dev,"re")))
+	{
+		fprintf(stderr,"Unable to open trace %s\n",c->unit[i].dev);
 		return -1;
 	}
+#else
+	/* listen for uevents first, thus no device creation is missed */
 
-	i=0;
-repeat:	if((fd=openpps(c->dev))==-1)
+	openuevent(c);
+
+	for(i=0,n=0;;)
 	{
+		for(j=0;j<c->units;j++)if(c->unit[j].ppsfd==-1)
+			if((c->unit[j].ppsfd=opensrc(&c->unit[j]))==-1)n++;
+		if(!n)break;
+		if(c->nlfd!=-1)
+		{
+			if(c->fg)for(j=0;j<c->units;j++)
+				if(c->unit[j].ppsfd==-1)fprintf(stderr,
+				"Waiting for pps device for %s\n",
+				c->unit[j].dev);
+			break;
+		}
 		if(i++<80)
 		{
 			usleep(25000);
-			goto repeat;
+			n=0;
+			continue;
 		}
 
-		fprintf(stderr,"Unable to access pps device for %s\n",c->dev);
+		for(j=0;j<c->units;j++)if(c->unit[j].ppsfd==-1)fprintf(stderr,
+			"Unable to access pps device for %s\n",c->unit[j].dev);
+		return -1;
+	}
+#endif
+
+#ifndef SIMULATE
+	if(c->sock&&UNLIKELY(opensock(c)))
+	{
+		fprintf(stderr,"Unable to create control socket %s\n",c->sock);
+		return -1;
+	}
+#endif
+
+	if(c->ring&&UNLIKELY(openring(c)))
+	{
+		fprintf(stderr,"Unable to create recording %s\n",c->ring);
 		return -1;
 	}
 
+#ifndef SIMULATE
 	if(LIKELY(!c->fg))
 	{
 		if(UNLIKELY(daemon(0,0)))
@@ -545,129 +4316,224 @@ repeat:	if((fd=openpps(c->dev))==-1)
 		}
 	}
 
-	if(UNLIKELY(timer_create(CLOCK_MONOTONIC,&sev,&c->id)))
+	/* memory locks are not inherited by the daemon child */
+
+	if(UNLIKELY(mlockall(MCL_CURRENT|MCL_FUTURE)))
 	{
-		perror("timer_create");
+		perror("mlockall");
 		return -1;
 	}
+#endif
 
-	return fd;
-}
-
-HOT int main(int argc,char *argv[])
-{
-	int ppsfd;
-	long delta;
-	long nsec;
-	struct common c;
-	struct pps_fdata data;
-
-	doterm=0;
+	if(UNLIKELY(openstat(c)))
+	{
+		fprintf(stderr,"Unable to create statistics\n");
+		return -1;
+	}
+	c->stat->pid=getpid();
+	__atomic_store_n(&c->stat->magic,SHMMAGIC,__ATOMIC_RELEASE);
 
-	memset(&data,0,sizeof(data));
-	data.timeout.sec=1;
-	data.timeout.nsec=100000000;
+#ifndef SIMULATE
+	sigemptyset(&set);
+	sigaddset(&set,SIGINT);
+	sigaddset(&set,SIGTERM);
+	sigaddset(&set,SIGHUP);
+	sigaddset(&set,SIGQUIT);
+	sigaddset(&set,SIGUSR2);
 
-	parse(argc,argv,&c);
-	if((ppsfd=prepare(&c))==-1)return 1;
+	if(UNLIKELY((c->sfd=signalfd(-1,&set,SFD_CLOEXEC))==-1)||
+	    UNLIKELY((c->efd=eventfd(0,EFD_CLOEXEC))==-1)||
+	    UNLIKELY((c->qfd=eventfd(0,EFD_CLOEXEC|EFD_NONBLOCK))==-1)||
+	    UNLIKELY(pthread_mutex_init(&c->qmtx,NULL))||
+	    UNLIKELY(pthread_cond_init(&c->qcond,NULL)))
+	{
+		fprintf(stderr,"Unable to create control channels\n");
+		return -1;
+	}
 
-	while(LIKELY(!doterm))
+	if(c->iprio)
 	{
-		if(UNLIKELY(c.first==1))
+		for(i=0;i<c->units;i++)
 		{
-			if(c.all)idleset(-1);
-			else modify(1,c.max,0);
-			c.first=2;
+			if((c->unit[i].irq=findirq(c->unit[i].dev))>0)
+				c->unit[i].sh->irq=c->unit[i].irq;
+			else if(c->fg)fprintf(stderr,
+				"No interrupt found for %s\n",c->unit[i].dev);
 		}
+		irqcheck(c);
+	}
 
-repeat:		if(UNLIKELY(ioctl(ppsfd,PPS_FETCH,&data)==-1))switch(errno)
-		{
-		case ETIMEDOUT:
-			if(!c.first)c.first=1;
-			continue;
-		case EINTR:
-			goto out;
-		default:goto repeat;
-		}
+	if(c->tasks)taskcheck(c);
 
-		if(UNLIKELY(c.first))
+	if(c->iprio||c->tasks)
+	{
+		memset(&its,0,sizeof(its));
+		its.it_value.tv_sec=its.it_interval.tv_sec=CHECKINT;
+		if(UNLIKELY((c->cfd=timerfd_create(CLOCK_MONOTONIC,
+			TFD_CLOEXEC))==-1)||
+		    UNLIKELY(timerfd_settime(c->cfd,0,&its,NULL)))
 		{
-			c.first=0;
-			c.state=0;
-			c.it.it_value.tv_nsec=0;
-			timer_settime(c.id,0,&c.it,NULL);
-			continue;
+			perror("timerfd");
+			return -1;
 		}
+	}
 
-		if(UNLIKELY(!data.info.clear_sequence)&&
-		    UNLIKELY(!data.info.clear_tu.sec)&&!data.info.clear_tu.nsec)
+	if(c->meter)
+	{
+		memset(&its,0,sizeof(its));
+		its.it_value.tv_sec=its.it_interval.tv_sec=c->meter;
+		if(UNLIKELY((c->mfd=timerfd_create(CLOCK_MONOTONIC,
+			TFD_CLOEXEC))==-1)||
+		    UNLIKELY(timerfd_settime(c->mfd,0,&its,NULL)))
 		{
-			delta=600000000;
-			nsec=data.info.assert_tu.nsec;
+			perror("timerfd");
+			return -1;
 		}
-		else if(data.info.assert_tu.sec>data.info.clear_tu.sec)
+	}
+
+	/* devices sharing a core share the event loop of the first one */
+
+	for(i=0;i<c->units;i++)
+	{
+		u=&c->unit[i];
+		for(j=0;c->unit[j].cpu!=u->cpu;j++);
+		g=&c->unit[j];
+
+		if(j==i)
 		{
-			nsec=data.info.assert_tu.nsec;
-			delta=data.info.assert_tu.sec-data.info.clear_tu.sec;
-			if(data.info.assert_tu.nsec<data.info.clear_tu.nsec)
+			if(UNLIKELY((u->epfd=epoll_create1(EPOLL_CLOEXEC))==-1)||
+			    UNLIKELY(addev(u->epfd,c->efd,EV_STOP,i))||
+			    (i&&UNLIKELY(addev(u->epfd,c->qfd,EV_QUIET,i)))||
+			    (!i&&UNLIKELY(addev(u->epfd,c->sfd,EV_SIGNAL,i)))||
+			    (!i&&c->ctl!=-1&&
+				UNLIKELY(addev(u->epfd,c->ctl,EV_CTL,i)))||
+			    (!i&&c->mfd!=-1&&
+				UNLIKELY(addev(u->epfd,c->mfd,EV_METER,i)))||
+			    (!i&&c->nlfd!=-1&&
+				UNLIKELY(addev(u->epfd,c->nlfd,EV_UEVENT,i)))||
+			    (!i&&c->cfd!=-1&&
+				UNLIKELY(addev(u->epfd,c->cfd,EV_CHECK,i))))
 			{
-				delta--;
-				data.info.assert_tu.nsec+=1000000000;
+				perror("epoll");
+				return -1;
 			}
-			delta+=data.info.assert_tu.nsec-data.info.clear_tu.nsec;
 		}
-		else if(data.info.assert_tu.sec<data.info.clear_tu.sec)
+
+		if(UNLIKELY((u->tfd=timerfd_create(CLOCK_MONOTONIC,
+			TFD_CLOEXEC))==-1))
 		{
-			nsec=data.info.clear_tu.nsec;
-			delta=data.info.clear_tu.sec-data.info.assert_tu.sec;
-			if(data.info.clear_tu.nsec<data.info.assert_tu.nsec)
-			{
-				delta--;
-				data.info.clear_tu.nsec+=1000000000;
-			}
-			delta+=data.info.clear_tu.nsec-data.info.assert_tu.nsec;
+			perror("timerfd_create");
+			return -1;
 		}
-		else if(data.info.assert_tu.nsec>data.info.clear_tu.nsec)
+
+		if(UNLIKELY(addev(g->epfd,u->tfd,EV_TIMER,i)))
 		{
-			delta=data.info.assert_tu.nsec-data.info.clear_tu.nsec;
-			nsec=data.info.assert_tu.nsec;
+			perror("epoll_ctl");
+			return -1;
 		}
-		else if(data.info.assert_tu.nsec<data.info.clear_tu.nsec)
+
+		if(u->ppsfd!=-1&&UNLIKELY(attach(u)))
 		{
-			delta=data.info.clear_tu.nsec-data.info.assert_tu.nsec;
-			nsec=data.info.clear_tu.nsec;
+			fprintf(stderr,"Unable to attach pps device for %s\n",
+				u->dev);
+			return -1;
 		}
-		else
+	}
+
+	for(i=1;i<c->units;i++)if(c->unit[i].epfd!=-1)
+	{
+		if(UNLIKELY(mkthread(&c->unit[i],&c->unit[i].tid,loop)))
 		{
-			if(!c.first)c.first=1;
-			continue;
+			fprintf(stderr,"Unable to create event loop thread\n");
+			return -1;
 		}
+		c->loops++;
+	}
+#endif
 
-		if(delta<600000000)continue;
+	return 0;
+}
 
-		if(nsec>=500000000)
-		{
-			nsec-=1000000000;
-			if(UNLIKELY(nsec<=-1000000))nsec=-999999;
-		}
-		else if(UNLIKELY(nsec>=1000000))nsec=999999;
+int main(int argc,char *argv[])
+{
+	int i;
+#ifndef SIMULATE
+	uint64_t val=1;
+#endif
+	struct common c;
 
-		c.state=0;
-		c.it.it_value.tv_nsec=c.pof-nsec;
-		timer_settime(c.id,0,&c.it,NULL);
-	}
+	doterm=0;
+
+	parse(argc,argv,&c);
+	if(c.dump)return dumpring(&c);
+	if(c.show)return showstat(&c);
+#ifdef SIMULATE
+	if(c.gen)return generate(&c);
+	if(prepare(&c))return 1;
+
+	simulate(&c);
+
+	for(i=0;i<c.units;i++)fclose(c.unit[i].trace);
+	for(i=0;i<c.idles;i++)closectl(&c.idle[i]);
+	fflush(stdout);
+	i=report(&c);
+	if(c.meter)closemeter(&c);
+	closering(&c);
+	closestat(&c);
+
+	return i?1:0;
+#else
+	if(c.tell)return client(&c);
+	if(c.cal)return calibrate(&c);
+	if(c.bench)return bench(&c);
+	if(prepare(&c))return 1;
+
+	run(&c.unit[0]);
 
-out:	c.it.it_value.tv_nsec=0;
-	timer_settime(c.id,0,&c.it,NULL);
-	timer_delete(c.id);
+	__atomic_store_n(&doterm,1,__ATOMIC_RELEASE);
+	if(write(c.efd,&val,sizeof(val))!=sizeof(val))perror("write");
 
-	if(c.all)idleset(-1);
-	else modify(1,c.max,0);
+	for(i=0;i<c.units;i++)
+	{
+		if(i&&c.unit[i].epfd!=-1)pthread_join(c.unit[i].tid,NULL);
+		if(c.unit[i].pfd[0]!=-1)
+		{
+			if(c.unit[i].ppsfd!=-1)
+			{
+				pthread_kill(c.unit[i].fid,SIGUSR1);
+				pthread_join(c.unit[i].fid,NULL);
+			}
+			close(c.unit[i].pfd[0]);
+			close(c.unit[i].pfd[1]);
+		}
+		if(c.unit[i].epfd!=-1)close(c.unit[i].epfd);
+		if(c.unit[i].wfd!=-1)close(c.unit[i].wfd);
+		close(c.unit[i].tfd);
+		if(c.unit[i].ppsfd!=-1)close(c.unit[i].ppsfd);
+	}
+	if(c.nlfd!=-1)close(c.nlfd);
+	if(c.cfd!=-1)close(c.cfd);
+	close(c.efd);
+	close(c.qfd);
+	close(c.sfd);
+	if(c.mfd!=-1)close(c.mfd);
+	pthread_cond_destroy(&c.qcond);
+	pthread_mutex_destroy(&c.qmtx);
+	if(c.ctl!=-1)
+	{
+		close(c.ctl);
+		unlink(c.sock);
+	}
 
-	closeidle(c.max);
-	close(ppsfd);
+	for(i=0;i<c.idles;i++)closectl(&c.idle[i]);
 
 	if(LIKELY(!c.fg))unlink(c.pid);
+	else report(&c);
+	if(c.meter)closemeter(&c);
+
+	closering(&c);
+	closestat(&c);
 
 	return 0;
+#endif
 }